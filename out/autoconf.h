@@ -0,0 +1,122 @@
+/*
+ *
+ * Automatically generated file; DO NOT EDIT.
+ * SeaBIOS Configuration
+ *
+ */
+#define CONFIG_BOOTSPLASH 1
+#define CONFIG_SMBIOS 1
+#define CONFIG_RELOCATE_INIT 1
+#define CONFIG_VGA_ALLOCATE_EXTRA_STACK 0
+#define CONFIG_USB_UHCI 1
+#define CONFIG_USB_UAS 1
+#define CONFIG_CSM 0
+#define CONFIG_DISK_STATS 1
+#define CONFIG_VIRTIO_SCSI 1
+#define CONFIG_VGA_OUTPUT_CRT 0
+#define CONFIG_USB_EHCI 1
+#define CONFIG_USB 1
+#define CONFIG_VGAHOOKS 1
+#define CONFIG_ATA 1
+#define CONFIG_ATA_DMA 1
+#define CONFIG_MOUSE 1
+#define CONFIG_UNAME_RELEASE "6.18.44-fc-v130"
+#define CONFIG_ACPI 1
+#define CONFIG_MPT_SCSI 1
+#define CONFIG_FW_ROMFILE_LOAD 1
+#define CONFIG_VGA_EMULATE_TEXT 0
+#define CONFIG_XEN 1
+#define CONFIG_VGA_BOCHS_VMWARE 0
+#define CONFIG_VGA_COREBOOT 0
+#define CONFIG_VGA_OUTPUT_PANEL 0
+#define CONFIG_NVME 1
+#define CONFIG_SDCARD 1
+#define CONFIG_ATA_PIO32 0
+#define CONFIG_THREADS 1
+#define CONFIG_DEBUG_SERIAL_MEM_ADDRESS 0
+#define CONFIG_BOOT 1
+#define CONFIG_LSI_SCSI 1
+#define CONFIG_DEBUG_SERIAL_PORT 0
+#define CONFIG_DEBUG_SERIAL_MMIO 0
+#define CONFIG_PMM 1
+#define CONFIG_LPT 1
+#define CONFIG_COREBOOT_FLASH 0
+#define CONFIG_BOOTPROF 1
+#define CONFIG_BUILD_VGABIOS 0
+#define CONFIG_QEMU_HARDWARE 1
+#define CONFIG_VGA_STDVGA_PORTS 0
+#define CONFIG_PIRTABLE 1
+#define CONFIG_MALLOC_STATS 0
+#define CONFIG_MALLOC_UPPERMEMORY 1
+#define CONFIG_CALL32_SMM 1
+#define CONFIG_DISABLE_A20 0
+#define CONFIG_NO_VGABIOS 1
+#define CONFIG_PNPBIOS 1
+#define CONFIG_FLASH_FLOPPY_LZMA 1
+#define CONFIG_ENTRY_EXTRASTACK 1
+#define CONFIG_VGA_VID 0
+#define CONFIG_OPTIONROMS 1
+#define CONFIG_VGA_EXTRA_STACK_SIZE 512
+#define CONFIG_WRITABLE_UPPERMEMORY 0
+#define CONFIG_FLASH_FLOPPY 1
+#define CONFIG_KEYBOARD 1
+#define CONFIG_KBD_CALL_INT15_4F 1
+#define CONFIG_DEBUG_IO 1
+#define CONFIG_RTC_TIMER 1
+#define CONFIG_TSC_TIMER 1
+#define CONFIG_TCGBIOS 1
+#define CONFIG_VGA_VBE 0
+#define CONFIG_FLOPPY_TRACK_BUFFER 1
+#define CONFIG_PVSCSI 1
+#define CONFIG_DRIVES 1
+#define CONFIG_VGA_GEODEGX2 0
+#define CONFIG_HARDWARE_IRQ 1
+#define CONFIG_VGA_GEODELX 0
+#define CONFIG_VGA_OUTPUT_CRT_PANEL 0
+#define CONFIG_BOOTORDER 1
+#define CONFIG_DEBUG_SERIAL 0
+#define CONFIG_ESP_SCSI 1
+#define CONFIG_PS2PORT 1
+#define CONFIG_VGA_BOCHS_VIRTIO 0
+#define CONFIG_SERIAL 1
+#define CONFIG_DEBUG_COREBOOT 0
+#define CONFIG_MEGASAS 1
+#define CONFIG_VGA_FIXUP_ASM 0
+#define CONFIG_MTRR_INIT 1
+#define CONFIG_ACPI_DSDT 1
+#define CONFIG_USB_KEYBOARD 1
+#define CONFIG_DEBUG_LEVEL 1
+#define CONFIG_AHCI 1
+#define CONFIG_S3_RESUME 1
+#define CONFIG_FLOPPY 1
+#define CONFIG_USB_HUB 1
+#define CONFIG_USB_XHCI 1
+#define CONFIG_OVERRIDE_PCI_ID 0
+#define CONFIG_USB_MSC 1
+#define CONFIG_PCIBIOS 1
+#define CONFIG_CBFS_LOCATION 0
+#define CONFIG_VGA_BOCHS_STDVGA 0
+#define CONFIG_CDROM_BOOT 1
+#define CONFIG_MULTIBOOT 0
+#define CONFIG_USB_MOUSE 1
+#define CONFIG_VGA_CIRRUS 0
+#define CONFIG_MAX_E820 32
+#define CONFIG_BOOTMENU 1
+#define CONFIG_QEMU 1
+#define CONFIG_VIRTIO_RING_PACKED 1
+#define CONFIG_MPTABLE 1
+#define CONFIG_VGA_BOCHS_QXL 0
+#define CONFIG_BLOCK_CACHE 1
+#define CONFIG_ROM_SIZE 0
+#define CONFIG_COREBOOT 0
+#define CONFIG_CDROM_EMU 1
+#define CONFIG_USB_OHCI 1
+#define CONFIG_LZMA 0
+#define CONFIG_VGA_PCI 0
+#define CONFIG_VIRTIO_BLK 1
+#define CONFIG_USE_SMM 1
+#define CONFIG_VGA_STANDARD_VGA 0
+#define CONFIG_VGA_DID 0
+#define CONFIG_APMBIOS 1
+#define CONFIG_PMTIMER 1
+#define CONFIG_VGA_BOCHS 0
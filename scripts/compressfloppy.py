@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+# Compress a floppy image into independently lzma compressed chunks.
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+import sys
+import struct
+import lzma
+import optparse
+
+MAGIC = 0x315a4452 # "RDZ1"
+
+def main():
+    opts = optparse.OptionParser("%prog [options] <infile> <outfile>")
+    opts.add_option("-c", "--chunk-size", type="int", dest="chunksize",
+                    default=32*1024, help="uncompressed bytes per chunk")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    infile, outfile = args
+    chunksize = options.chunksize
+    if chunksize % 512 or chunksize <= 0 or chunksize > 64*1024:
+        opts.error("Chunk size must be a multiple of 512 up to 65536")
+
+    data = open(infile, 'rb').read()
+    chunks = [lzma.compress(data[i:i+chunksize], format=lzma.FORMAT_ALONE)
+              for i in range(0, len(data), chunksize)]
+
+    # Header, chunk offsets (plus end offset), then the chunk data
+    offset = 16 + 4 * (len(chunks) + 1)
+    offsets = []
+    for c in chunks:
+        offsets.append(offset)
+        offset += len(c)
+    offsets.append(offset)
+    out = struct.pack('<IIII', MAGIC, len(data), chunksize, len(chunks))
+    out += struct.pack('<%dI' % len(offsets), *offsets)
+    out += b''.join(chunks)
+
+    f = open(outfile, 'wb')
+    f.write(out)
+    f.close()
+    sys.stdout.write("%d bytes -> %d bytes in %d chunks\n" % (
+        len(data), len(out), len(chunks)))
+
+if __name__ == '__main__':
+    main()
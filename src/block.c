@@ -23,6 +23,7 @@
 #include "hw/nvme.h" // nvme_process_op
 #include "malloc.h" // malloc_low
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_loadint
 #include "stacks.h" // call32
 #include "std/disk.h" // struct dpte_s
 #include "string.h" // checksum
@@ -484,6 +485,182 @@ fill_edd(struct segoff_s edd, struct drive_s *drive_gf)
 }
 
 
+/****************************************************************
+ * Block cache
+ ****************************************************************/
+
+#define BLOCKCACHE_LINE_SIZE 4096
+#define BLOCKCACHE_LINE_SECTORS (BLOCKCACHE_LINE_SIZE / DISK_SECTOR_SIZE)
+// Number of extra lines read when a drive is read sequentially.
+#define BLOCKCACHE_READAHEAD 8
+// Reads larger than this (in sectors) bypass the cache.
+#define BLOCKCACHE_MAX_READ (BLOCKCACHE_READAHEAD * BLOCKCACHE_LINE_SECTORS)
+
+struct blockcache_line_s {
+    struct drive_s *drive;
+    u64 lba;
+};
+
+struct blockcache_s {
+    u32 count;
+    struct blockcache_line_s *lines;
+    u8 *data;
+    // Sequential read detection
+    struct drive_s *last_drive;
+    u64 next_lba;
+    // Statistics
+    u32 hits, misses, fills, bypass;
+};
+
+static struct blockcache_s *BlockCache;
+
+static void
+block_cache_setup(void)
+{
+    if (!CONFIG_BLOCK_CACHE)
+        return;
+    u32 count = (romfile_loadint("etc/block-cache-size", 64) * 1024
+                 / BLOCKCACHE_LINE_SIZE);
+    if (!count)
+        return;
+    struct blockcache_s *bc = malloc_high(sizeof(*bc));
+    struct blockcache_line_s *lines = malloc_high(sizeof(*lines) * count);
+    u8 *data = memalign_high(PAGE_SIZE, count * BLOCKCACHE_LINE_SIZE);
+    if (!bc || !lines || !data) {
+        warn_noalloc();
+        free(bc);
+        free(lines);
+        free(data);
+        return;
+    }
+    memset(bc, 0, sizeof(*bc));
+    memset(lines, 0, sizeof(*lines) * count);
+    bc->count = count;
+    bc->lines = lines;
+    bc->data = data;
+    BlockCache = bc;
+    dprintf(1, "Block cache: %d KiB\n", count * BLOCKCACHE_LINE_SIZE / 1024);
+}
+
+void
+block_cache_prepboot(void)
+{
+    struct blockcache_s *bc = BlockCache;
+    if (!CONFIG_BLOCK_CACHE || !bc)
+        return;
+    dprintf(1, "Block cache: %u hits, %u misses, %u device reads"
+            ", %u bypassed\n", bc->hits, bc->misses, bc->fills, bc->bypass);
+}
+
+static int process_op_driver_32(struct disk_op_s *op);
+
+// Lines are direct mapped; consecutive lines of a drive use consecutive
+// slots so that read-ahead can fill several lines with one request.
+static u32
+block_cache_slot(struct blockcache_s *bc, struct drive_s *drive, u64 lba)
+{
+    return ((u32)(lba / BLOCKCACHE_LINE_SECTORS) + ((u32)drive >> 4)) % bc->count;
+}
+
+// Read 'nlines' lines starting at 'lba' into the cache at 'slot'.
+static int
+block_cache_fill(struct blockcache_s *bc, struct drive_s *drive, u64 lba
+                 , u32 slot, u32 nlines)
+{
+    struct disk_op_s fop;
+    memset(&fop, 0, sizeof(fop));
+    fop.drive_gf = drive;
+    fop.command = CMD_READ;
+    fop.lba = lba;
+    fop.count = nlines * BLOCKCACHE_LINE_SECTORS;
+    fop.buf_fl = bc->data + slot * BLOCKCACHE_LINE_SIZE;
+
+    int i;
+    for (i = 0; i < nlines; i++)
+        bc->lines[slot + i].drive = NULL;
+    bc->fills++;
+    int ret = process_op_driver_32(&fop);
+    if (ret)
+        return ret;
+    for (i = 0; i < nlines; i++) {
+        bc->lines[slot + i].drive = drive;
+        bc->lines[slot + i].lba = lba + i * BLOCKCACHE_LINE_SECTORS;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+static int
+block_cache_read(struct blockcache_s *bc, struct disk_op_s *op)
+{
+    struct drive_s *drive = op->drive_gf;
+    int sequential = drive == bc->last_drive && op->lba == bc->next_lba;
+    bc->last_drive = drive;
+    bc->next_lba = op->lba + op->count;
+
+    u64 end = op->lba + op->count;
+    u64 lastline = ALIGN(end, BLOCKCACHE_LINE_SECTORS);
+    if (op->count > BLOCKCACHE_MAX_READ || lastline > drive->sectors) {
+        bc->bypass++;
+        return process_op_driver_32(op);
+    }
+
+    u16 done = 0;
+    while (done < op->count) {
+        u64 lba = op->lba + done;
+        u64 linelba = ALIGN_DOWN(lba, BLOCKCACHE_LINE_SECTORS);
+        u32 slot = block_cache_slot(bc, drive, lba);
+        struct blockcache_line_s *line = &bc->lines[slot];
+        if (line->drive == drive && line->lba == linelba) {
+            bc->hits++;
+        } else {
+            // Fetch the rest of the request (plus read-ahead) in one go
+            bc->misses++;
+            u32 nlines = (lastline - linelba) / BLOCKCACHE_LINE_SECTORS;
+            if (sequential)
+                nlines += BLOCKCACHE_READAHEAD;
+            if (nlines > bc->count - slot)
+                nlines = bc->count - slot;
+            u64 maxlines = (drive->sectors - linelba) / BLOCKCACHE_LINE_SECTORS;
+            if (nlines > maxlines)
+                nlines = maxlines;
+            int ret = block_cache_fill(bc, drive, linelba, slot, nlines);
+            if (ret) {
+                op->count = done;
+                return ret;
+            }
+        }
+        u32 offset = lba - linelba;
+        u32 count = BLOCKCACHE_LINE_SECTORS - offset;
+        if (count > op->count - done)
+            count = op->count - done;
+        memcpy(op->buf_fl + done * DISK_SECTOR_SIZE
+               , bc->data + slot * BLOCKCACHE_LINE_SIZE
+                 + offset * DISK_SECTOR_SIZE
+               , count * DISK_SECTOR_SIZE);
+        done += count;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+static int
+block_cache_write(struct blockcache_s *bc, struct disk_op_s *op)
+{
+    struct drive_s *drive = op->drive_gf;
+    u64 start = ALIGN_DOWN(op->lba, BLOCKCACHE_LINE_SECTORS);
+    u64 end = op->lba + op->count;
+    int ret = process_op_driver_32(op);
+
+    // Write-through: drop any cached copy of the written sectors
+    int i;
+    for (i = 0; i < bc->count; i++) {
+        struct blockcache_line_s *line = &bc->lines[i];
+        if (line->drive == drive && line->lba >= start && line->lba < end)
+            line->drive = NULL;
+    }
+    return ret;
+}
+
+
 /****************************************************************
  * Disk driver dispatch
  ****************************************************************/
@@ -491,6 +668,7 @@ fill_edd(struct segoff_s edd, struct drive_s *drive_gf)
 void
 block_setup(void)
 {
+    block_cache_setup();
     floppy_setup();
     ata_setup();
     ahci_setup();
@@ -552,8 +730,8 @@ process_op_both(struct disk_op_s *op)
 }
 
 // Command dispatch for disk drivers that only run in 32bit mode
-int VISIBLE32FLAT
-process_op_32(struct disk_op_s *op)
+static int
+process_op_driver_32(struct disk_op_s *op)
 {
     ASSERT32FLAT();
     switch (op->drive_gf->type) {
@@ -575,11 +753,30 @@ process_op_32(struct disk_op_s *op)
         return pvscsi_process_op(op);
     case DTYPE_NVME:
         return nvme_process_op(op);
+    case DTYPE_RAMDISK_LZMA:
+        return ramdisk_lzma_process_op(op);
     default:
         return process_op_both(op);
     }
 }
 
+// Command dispatch for 32bit mode (with optional block cache)
+int VISIBLE32FLAT
+process_op_32(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    struct blockcache_s *bc = BlockCache;
+    if (CONFIG_BLOCK_CACHE && bc && op->drive_gf->blksize == DISK_SECTOR_SIZE) {
+        switch (op->command) {
+        case CMD_READ:
+            return block_cache_read(bc, op);
+        case CMD_WRITE:
+            return block_cache_write(bc, op);
+        }
+    }
+    return process_op_driver_32(op);
+}
+
 // Command dispatch for disk drivers that only run in 16bit mode
 static int
 process_op_16(struct disk_op_s *op)
@@ -599,6 +796,99 @@ process_op_16(struct disk_op_s *op)
     }
 }
 
+
+/****************************************************************
+ * Disk statistics
+ ****************************************************************/
+
+#define DISK_STATS_MAX 8
+
+struct disk_stats_s DiskStats[CONFIG_DISK_STATS ? DISK_STATS_MAX : 0] VARLOW;
+
+// Find (or allocate) the statistics entry for a drive.
+struct disk_stats_s *
+disk_stats_find(struct drive_s *drive_gf)
+{
+    if (!CONFIG_DISK_STATS)
+        return NULL;
+    int i;
+    for (i=0; i<ARRAY_SIZE(DiskStats); i++) {
+        struct drive_s *d = GET_LOW(DiskStats[i].drive_gf);
+        if (d == drive_gf)
+            return &DiskStats[i];
+        if (!d) {
+            SET_LOW(DiskStats[i].drive_gf, drive_gf);
+            return &DiskStats[i];
+        }
+    }
+    return NULL;
+}
+
+// Note that a driver had to copy a request through a bounce buffer.
+void
+disk_stats_bounce(struct disk_op_s *op)
+{
+    struct disk_stats_s *st = disk_stats_find(op->drive_gf);
+    if (st)
+        SET_LOW(st->bounced, GET_LOW(st->bounced) + 1);
+}
+
+static void
+disk_stats_record(struct disk_op_s *op, int ret, u32 start)
+{
+    struct disk_stats_s *st = disk_stats_find(op->drive_gf);
+    if (!st)
+        return;
+    u32 usec = timer_ticks_to_usec(timer_read() - start);
+    switch (op->command) {
+    case CMD_READ:
+        SET_LOW(st->reads, GET_LOW(st->reads) + 1);
+        SET_LOW(st->read_sectors, GET_LOW(st->read_sectors) + op->count);
+        break;
+    case CMD_WRITE:
+        SET_LOW(st->writes, GET_LOW(st->writes) + 1);
+        SET_LOW(st->write_sectors, GET_LOW(st->write_sectors) + op->count);
+        break;
+    default:
+        SET_LOW(st->other, GET_LOW(st->other) + 1);
+        break;
+    }
+    if (ret)
+        SET_LOW(st->errors, GET_LOW(st->errors) + 1);
+    SET_LOW(st->total_usec, GET_LOW(st->total_usec) + usec);
+    if (usec > GET_LOW(st->max_usec))
+        SET_LOW(st->max_usec, usec);
+    int bucket = 0;
+    while (bucket < DISK_STATS_BUCKETS - 1 && usec >= (16 << (2 * bucket)))
+        bucket++;
+    SET_LOW(st->latency[bucket], GET_LOW(st->latency[bucket]) + 1);
+}
+
+// Report the statistics gathered during POST on the debug console.
+void
+disk_stats_prepboot(void)
+{
+    if (!CONFIG_DISK_STATS)
+        return;
+    int i;
+    for (i=0; i<ARRAY_SIZE(DiskStats); i++) {
+        struct disk_stats_s *st = &DiskStats[i];
+        if (!st->drive_gf)
+            break;
+        dprintf(1, "disk stats %p type=%x: rd=%u/%u wr=%u/%u other=%u"
+                " err=%u bounce=%u time=%uus max=%uus\n"
+                , st->drive_gf, st->drive_gf->type
+                , st->reads, st->read_sectors, st->writes, st->write_sectors
+                , st->other, st->errors, st->bounced
+                , st->total_usec, st->max_usec);
+        dprintf(1, "  latency <16us:%u <64us:%u <256us:%u <1ms:%u <4ms:%u"
+                " <16ms:%u <64ms:%u more:%u\n"
+                , st->latency[0], st->latency[1], st->latency[2]
+                , st->latency[3], st->latency[4], st->latency[5]
+                , st->latency[6], st->latency[7]);
+    }
+}
+
 // Execute a disk_op_s request.
 int
 process_op(struct disk_op_s *op)
@@ -612,6 +902,7 @@ process_op(struct disk_op_s *op)
         op->count = 0;
         return DISK_RET_EBOUNDARY;
     }
+    u32 start = CONFIG_DISK_STATS ? timer_read() : 0;
     if (MODESEGMENT)
         ret = process_op_16(op);
     else
@@ -619,5 +910,7 @@ process_op(struct disk_op_s *op)
     if (ret && op->count == origcount)
         // If the count hasn't changed on error, assume no data transferred.
         op->count = 0;
+    if (CONFIG_DISK_STATS)
+        disk_stats_record(op, ret, start);
     return ret;
 }
@@ -59,6 +59,20 @@ struct drive_s {
     struct chs_s pchs;  // Physical CHS
 };
 
+// Per drive I/O statistics.  The counters (up to, but not including,
+// drive_gf) are what int 13h ah=fa returns.
+#define DISK_STATS_BUCKETS 8 // latency buckets: <16us, <64us, ... <64ms, more
+struct disk_stats_s {
+    u32 reads, writes, other;
+    u32 errors;
+    u32 read_sectors, write_sectors;
+    u32 bounced;
+    u32 total_usec, max_usec;
+    u32 latency[DISK_STATS_BUCKETS];
+    // Internal - not exported
+    struct drive_s *drive_gf;
+};
+
 #define DISK_SECTOR_SIZE  512
 #define CDROM_SECTOR_SIZE 2048
 
@@ -67,6 +81,7 @@ struct drive_s {
 #define DTYPE_ATA          0x20
 #define DTYPE_ATA_ATAPI    0x21
 #define DTYPE_RAMDISK      0x30
+#define DTYPE_RAMDISK_LZMA 0x31
 #define DTYPE_CDEMU        0x40
 #define DTYPE_AHCI         0x50
 #define DTYPE_AHCI_ATAPI   0x51
@@ -113,9 +128,13 @@ void map_hd_drive(struct drive_s *drive);
 void map_cd_drive(struct drive_s *drive);
 struct int13dpt_s;
 int fill_edd(struct segoff_s edd, struct drive_s *drive_gf);
+void block_cache_prepboot(void);
 void block_setup(void);
 int default_process_op(struct disk_op_s *op);
 int process_op(struct disk_op_s *op);
 int create_bounce_buf(void);
+struct disk_stats_s *disk_stats_find(struct drive_s *drive_gf);
+void disk_stats_bounce(struct disk_op_s *op);
+void disk_stats_prepboot(void);
 
 #endif // block.h
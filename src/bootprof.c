@@ -0,0 +1,194 @@
+// Boot phase timeline profiling.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "config.h" // CONFIG_BOOTPROF
+#include "fw/paravirt.h" // qemu_cfg_write_file
+#include "malloc.h" // malloc_high
+#include "output.h" // dprintf
+#include "romfile.h" // romfile_find
+#include "string.h" // memset
+#include "util.h" // timer_read
+
+#define BOOTPROF_SIGNATURE 0x46505442 // BTPF
+#define BOOTPROF_VERSION 1
+#define BOOTPROF_MAX 256
+
+// Layout of the log in memory and of the "etc/boot-timeline" fw_cfg file.
+struct bootprof_header_s {
+    u32 signature;
+    u16 version;
+    u16 entry_size;
+    u16 count;
+    u16 dropped;
+    u32 total_usec;
+};
+
+struct bootprof_entry_s {
+    u32 start_usec;
+    u32 duration_usec;
+    u32 id;
+    u8 type;
+    char name[19];
+};
+
+static struct bootprof_header_s *BootProf;
+static struct bootprof_entry_s *BootProfEntries;
+
+// Microseconds since profiling started - accumulated between timer
+// samples so that a change of the internal time base can be bridged.
+static u32 ProfUsec, ProfLast, ProfStarted;
+
+// The currently running phase.
+static const char *CurPhase;
+static u32 CurPhaseStart;
+
+static u32
+bootprof_now(void)
+{
+    u32 t = timer_read();
+    if (ProfStarted)
+        ProfUsec += timer_ticks_to_usec(t - ProfLast);
+    ProfStarted = 1;
+    ProfLast = t;
+    return ProfUsec;
+}
+
+// The internal timer is about to be switched to a new source - account
+// for the time passed so far using the old source.
+void
+bootprof_timer_prechange(void)
+{
+    if (!CONFIG_BOOTPROF || !ProfStarted)
+        return;
+    bootprof_now();
+}
+
+// The internal timer now uses its new source - continue from its
+// current value.
+void
+bootprof_timer_postchange(void)
+{
+    if (!CONFIG_BOOTPROF || !ProfStarted)
+        return;
+    ProfLast = timer_read();
+}
+
+static int
+bootprof_add(int type, const char *name, u32 id, u32 start)
+{
+    if (!BootProf)
+        return -1;
+    if (BootProf->count >= BOOTPROF_MAX) {
+        BootProf->dropped++;
+        return -1;
+    }
+    int idx = BootProf->count++;
+    struct bootprof_entry_s *e = &BootProfEntries[idx];
+    e->start_usec = start;
+    e->duration_usec = 0;
+    e->id = id;
+    e->type = type;
+    strtcpy(e->name, name, sizeof(e->name));
+    return idx;
+}
+
+// Start timing a task - returns a handle for bootprof_stop().
+int
+bootprof_start(int type, const char *name, u32 id)
+{
+    if (!CONFIG_BOOTPROF)
+        return -1;
+    return bootprof_add(type, name, id, bootprof_now());
+}
+
+void
+bootprof_stop(int idx)
+{
+    if (!CONFIG_BOOTPROF || !BootProf || idx < 0)
+        return;
+    struct bootprof_entry_s *e = &BootProfEntries[idx];
+    e->duration_usec = bootprof_now() - e->start_usec;
+}
+
+// End the current boot phase (if any) and start phase 'name'.
+void
+bootprof_phase(const char *name)
+{
+    if (!CONFIG_BOOTPROF)
+        return;
+    u32 now = bootprof_now();
+    if (CurPhase) {
+        int idx = bootprof_add(BOOTPROF_PHASE, CurPhase, 0, CurPhaseStart);
+        if (idx >= 0)
+            BootProfEntries[idx].duration_usec = now - CurPhaseStart;
+    }
+    CurPhase = name;
+    CurPhaseStart = now;
+}
+
+// Allocate the log (called once malloc is available).
+void
+bootprof_setup(void)
+{
+    if (!CONFIG_BOOTPROF)
+        return;
+    u32 size = sizeof(*BootProf) + BOOTPROF_MAX * sizeof(*BootProfEntries);
+    BootProf = malloc_high(size);
+    if (!BootProf) {
+        warn_noalloc();
+        return;
+    }
+    memset(BootProf, 0, size);
+    BootProf->signature = BOOTPROF_SIGNATURE;
+    BootProf->version = BOOTPROF_VERSION;
+    BootProf->entry_size = sizeof(*BootProfEntries);
+    BootProfEntries = (void*)&BootProf[1];
+}
+
+static const char *
+bootprof_typename(int type)
+{
+    switch (type) {
+    case BOOTPROF_PHASE: return "phase";
+    case BOOTPROF_THREAD: return "thread";
+    case BOOTPROF_OPTIONROM: return "optionrom";
+    case BOOTPROF_BCV: return "bcv";
+    default: return "?";
+    }
+}
+
+// Close the final phase and export the log.
+void
+bootprof_finish(void)
+{
+    if (!CONFIG_BOOTPROF)
+        return;
+    bootprof_phase(NULL);
+    if (!BootProf)
+        return;
+    BootProf->total_usec = bootprof_now();
+
+    u32 size = sizeof(*BootProf) + BootProf->count * sizeof(*BootProfEntries);
+    struct romfile_s *file = romfile_find("etc/boot-timeline");
+    if (CONFIG_QEMU && file && qemu_cfg_dma_enabled()) {
+        u32 len = size < file->size ? size : file->size;
+        if (qemu_cfg_write_file(BootProf, file, 0, len) >= 0) {
+            dprintf(1, "Boot timeline: %d entries written to fw_cfg\n"
+                    , BootProf->count);
+            return;
+        }
+    }
+
+    // No writable fw_cfg file - send the log to the debug console.
+    dprintf(1, "boot-timeline: total=%u entries=%d dropped=%d log=%p\n"
+            , BootProf->total_usec, BootProf->count, BootProf->dropped
+            , BootProf);
+    int i;
+    for (i=0; i<BootProf->count; i++) {
+        struct bootprof_entry_s *e = &BootProfEntries[i];
+        dprintf(3, "boot-timeline: %s %s id=%08x start=%u dur=%u\n"
+                , bootprof_typename(e->type), e->name, e->id
+                , e->start_usec, e->duration_usec);
+    }
+}
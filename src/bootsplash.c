@@ -103,9 +103,10 @@ enable_bootsplash(void)
     dprintf(3, "Checking for bootsplash\n");
     u8 type = 0; /* 0 means jpg, 1 means bmp, default is 0=jpg */
     int filesize;
-    u8 *filedata = romfile_loadfile("bootsplash.jpg", &filesize);
+    struct arena_s arena = { .zone = &ZoneTmpHigh };
+    u8 *filedata = romfile_loadfile_arena(&arena, "bootsplash.jpg", &filesize);
     if (!filedata) {
-        filedata = romfile_loadfile("bootsplash.bmp", &filesize);
+        filedata = romfile_loadfile_arena(&arena, "bootsplash.bmp", &filesize);
         if (!filedata)
             return;
         type = 1;
@@ -194,7 +195,7 @@ enable_bootsplash(void)
 
     // Allocate space for image and decompress it.
     int imagesize = height * mode_info->bytes_per_scanline;
-    picture = malloc_tmphigh(imagesize);
+    picture = arena_alloc(&arena, imagesize, MALLOC_MIN_ALIGN);
     if (!picture) {
         warn_noalloc();
         goto done;
@@ -236,8 +237,7 @@ enable_bootsplash(void)
     BootsplashActive = 1;
 
 done:
-    free(filedata);
-    free(picture);
+    arena_release(&arena, NULL);
     free(vesa_info);
     free(mode_info);
     free(jpeg);
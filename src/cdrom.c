@@ -26,6 +26,53 @@ struct eltorito_s CDEmu VARLOW = { .size=sizeof(CDEmu) };
 struct drive_s *emulated_drive_gf VARLOW;
 struct drive_s *cdemu_drive_gf VARFSEG;
 
+// Cache of recently read cd sectors - emulated drives use 512 byte
+// sectors, so sequential reads touch each cd sector up to four times.
+#define CDEMU_CACHE_SECTORS 2
+u8 *CDEmuCache VARFSEG;
+u32 CDEmuCacheLba[CDEMU_CACHE_SECTORS] VARLOW;
+u8 CDEmuCacheNext VARLOW;
+
+static void
+cdemu_cache_flush(void)
+{
+    memset(CDEmuCacheLba, 0xff, sizeof(CDEmuCacheLba));
+    CDEmuCacheNext = 0;
+}
+
+// Copy 'count' 512 byte blocks starting at block 'first' of cd sector
+// 'lba' to 'buf_fl', reading the sector into the cache if needed.
+static int
+cdemu_read_partial(struct drive_s *drive_gf, u32 lba, void *buf_fl
+                   , int first, int count)
+{
+    u8 *cache_fl = GET_GLOBAL(CDEmuCache);
+    int slot;
+    for (slot=0; slot<CDEMU_CACHE_SECTORS; slot++)
+        if (GET_LOW(CDEmuCacheLba[slot]) == lba)
+            goto found;
+
+    // Not cached - replace the oldest entry.
+    slot = GET_LOW(CDEmuCacheNext);
+    SET_LOW(CDEmuCacheNext, (slot + 1) % CDEMU_CACHE_SECTORS);
+    SET_LOW(CDEmuCacheLba[slot], (u32)-1);
+    struct disk_op_s dop;
+    dop.drive_gf = drive_gf;
+    dop.command = CMD_READ;
+    dop.lba = lba;
+    dop.count = 1;
+    dop.buf_fl = cache_fl + slot * CDROM_SECTOR_SIZE;
+    int ret = process_op(&dop);
+    if (ret)
+        return ret;
+    SET_LOW(CDEmuCacheLba[slot], lba);
+
+found:
+    memcpy_fl(buf_fl, cache_fl + slot * CDROM_SECTOR_SIZE
+              + first * DISK_SECTOR_SIZE, count * DISK_SECTOR_SIZE);
+    return DISK_RET_SUCCESS;
+}
+
 static int
 cdemu_read(struct disk_op_s *op)
 {
@@ -37,34 +84,31 @@ cdemu_read(struct disk_op_s *op)
 
     int count = op->count;
     op->count = 0;
-    u8 *cdbuf_fl = GET_GLOBAL(bounce_buf_fl);
 
     if (op->lba & 3) {
         // Partial read of first block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
-        if (ret)
-            return ret;
-        u8 thiscount = 4 - (op->lba & 3);
+        int thiscount = 4 - (op->lba & 3);
         if (thiscount > count)
             thiscount = count;
+        int ret = cdemu_read_partial(drive_gf, dop.lba, op->buf_fl
+                                     , op->lba & 3, thiscount);
+        if (ret)
+            return ret;
         count -= thiscount;
-        memcpy_fl(op->buf_fl, cdbuf_fl + (op->lba & 3) * 512, thiscount * 512);
         op->buf_fl += thiscount * 512;
         op->count += thiscount;
         dop.lba++;
     }
 
     if (count > 3) {
-        // Read n number of regular blocks.
+        // Read n number of regular blocks directly into the caller buffer.
         dop.count = count / 4;
         dop.buf_fl = op->buf_fl;
         int ret = process_op(&dop);
         op->count += dop.count * 4;
         if (ret)
             return ret;
-        u8 thiscount = count & ~3;
+        int thiscount = count & ~3;
         count &= 3;
         op->buf_fl += thiscount * 512;
         dop.lba += thiscount / 4;
@@ -72,14 +116,10 @@ cdemu_read(struct disk_op_s *op)
 
     if (count) {
         // Partial read on last block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
+        int ret = cdemu_read_partial(drive_gf, dop.lba, op->buf_fl, 0, count);
         if (ret)
             return ret;
-        u8 thiscount = count;
-        memcpy_fl(op->buf_fl, cdbuf_fl, thiscount * 512);
-        op->count += thiscount;
+        op->count += count;
     }
 
     return DISK_RET_SUCCESS;
@@ -109,8 +149,13 @@ cdrom_prepboot(void)
         return;
     if (!CDCount)
         return;
-    if (create_bounce_buf() < 0)
+    u8 *cache = malloc_low(CDEMU_CACHE_SECTORS * CDROM_SECTOR_SIZE);
+    if (!cache) {
+        warn_noalloc();
         return;
+    }
+    CDEmuCache = cache;
+    cdemu_cache_flush();
 
     struct drive_s *drive = malloc_fseg(sizeof(*drive));
     if (!drive) {
@@ -189,6 +234,7 @@ cdrom_boot(struct drive_s *drive)
 
     // Fill in el-torito cdrom emulation fields.
     emulated_drive_gf = drive;
+    cdemu_cache_flush();
     u8 media = buffer[0x21];
 
     u16 boot_segment = *(u16*)&buffer[0x22];
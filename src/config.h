@@ -14,8 +14,6 @@
 #define BUILD_APPNAME6 "BOCHS "
 #define BUILD_APPNAME4 "BXPC"
 
-// Maximum number of map entries in the e820 map
-#define BUILD_MAX_E820 32
 // Space to reserve in high-memory for tables
 #define BUILD_MAX_HIGHTABLE (256*1024)
 // Largest supported externaly facing drive id
@@ -404,6 +404,27 @@ disk_1316(struct bregs *regs, struct drive_s *drive_gf)
     disk_ret(regs, DISK_RET_ECHANGED);
 }
 
+// Vendor: read disk I/O statistics of a drive into es:di (cx bytes).
+// Setting al=1 also clears the counters.
+static void
+disk_13fa(struct bregs *regs, struct drive_s *drive_gf)
+{
+    struct disk_stats_s *st = disk_stats_find(drive_gf);
+    if (!CONFIG_DISK_STATS || !st) {
+        disk_ret(regs, DISK_RET_EPARAM);
+        return;
+    }
+    // Only the counters are returned - not the internal drive pointer.
+    u16 size = regs->cx, max = offsetof(struct disk_stats_s, drive_gf);
+    if (size > max)
+        size = max;
+    memcpy_far(regs->es, (void*)(regs->di+0), SEG_LOW, st, size);
+    if (regs->al == 0x01)
+        memset_far(SEG_LOW, st, 0, max);
+    regs->cx = size;
+    disk_ret(regs, DISK_RET_SUCCESS);
+}
+
 // IBM/MS installation check
 static void
 disk_1341(struct bregs *regs, struct drive_s *drive_gf)
@@ -651,6 +672,7 @@ disk_13(struct bregs *regs, struct drive_s *drive_gf)
     case 0x48: disk_1348(regs, drive_gf); break;
     case 0x49: disk_1349(regs, drive_gf); break;
     case 0x4e: disk_134e(regs, drive_gf); break;
+    case 0xfa: disk_13fa(regs, drive_gf); break;
     default:   disk_13XX(regs, drive_gf); break;
     }
 }
@@ -669,6 +691,7 @@ floppy_13(struct bregs *regs, struct drive_s *drive_gf)
     case 0x08:
     case 0x15:
     case 0x16:
+    case 0xfa:
         disk_13(regs, drive_gf);
         break;
     default:   disk_13XX(regs, drive_gf); break;
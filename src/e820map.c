@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
-#include "config.h" // BUILD_MAX_E820
+#include "config.h" // CONFIG_MAX_E820
 #include "e820map.h" // struct e820entry
 #include "output.h" // dprintf
 #include "string.h" // memmove
@@ -15,15 +15,34 @@
  ****************************************************************/
 
 // Info on e820 map location and size.
-struct e820entry e820_list[BUILD_MAX_E820] VARFSEG;
+struct e820entry e820_list[CONFIG_MAX_E820] VARFSEG;
 int e820_count VARFSEG;
 
-// Remove an entry from the e820_list.
+// Find the first entry in the (sorted) e820_list that ends at or
+// after the given address.
+static int
+find_e820(u64 start)
+{
+    int lo = 0, hi = e820_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        struct e820entry *e = &e820_list[mid];
+        if (start > e->start + e->size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Remove 'count' entries from the e820_list.
 static void
-remove_e820(int i)
+remove_e820(int i, int count)
 {
-    e820_count--;
-    memmove(&e820_list[i], &e820_list[i+1]
+    if (!count)
+        return;
+    e820_count -= count;
+    memmove(&e820_list[i], &e820_list[i+count]
             , sizeof(e820_list[0]) * (e820_count - i));
 }
 
@@ -31,7 +50,7 @@ remove_e820(int i)
 static void
 insert_e820(int i, u64 start, u64 size, u32 type)
 {
-    if (e820_count >= BUILD_MAX_E820) {
+    if (e820_count >= CONFIG_MAX_E820) {
         warn_noalloc();
         return;
     }
@@ -87,13 +106,10 @@ e820_add(u64 start, u64 size, u32 type)
 
     // Find position of new item (splitting existing item if needed).
     u64 end = start + size;
-    int i;
-    for (i=0; i<e820_count; i++) {
+    int i = find_e820(start);
+    if (i < e820_count) {
         struct e820entry *e = &e820_list[i];
         u64 e_end = e->start + e->size;
-        if (start > e_end)
-            continue;
-        // Found position - check if an existing item needs to be split.
         if (start > e->start) {
             if (type == e->type) {
                 // Same type - merge them.
@@ -107,18 +123,18 @@ e820_add(u64 start, u64 size, u32 type)
                     insert_e820(i, end, e_end - end, e->type);
             }
         }
-        break;
     }
     // Remove/adjust existing items that are overlapping.
-    while (i<e820_count) {
-        struct e820entry *e = &e820_list[i];
+    int j = i;
+    while (j<e820_count) {
+        struct e820entry *e = &e820_list[j];
         if (end < e->start)
             // No overlap - done.
             break;
         u64 e_end = e->start + e->size;
         if (end >= e_end) {
             // Existing item completely overlapped - remove it.
-            remove_e820(i);
+            j++;
             continue;
         }
         // Not completely overlapped - adjust its start.
@@ -127,10 +143,11 @@ e820_add(u64 start, u64 size, u32 type)
         if (type == e->type) {
             // Same type - merge them.
             size += e->size;
-            remove_e820(i);
+            j++;
         }
         break;
     }
+    remove_e820(i, j - i);
     // Insert new item.
     if (type != E820_HOLE)
         insert_e820(i, start, size, type);
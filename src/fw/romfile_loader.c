@@ -210,7 +210,8 @@ int romfile_loader_execute(const char *name)
     struct romfile_loader_entry_s *entry;
     int size, offset = 0, nfiles;
     struct romfile_loader_files *files;
-    void *data = romfile_loadfile(name, &size);
+    struct arena_s arena = { .zone = &ZoneTmpHigh };
+    void *data = romfile_loadfile_arena(&arena, name, &size);
     if (!data)
         return -1;
 
@@ -221,7 +222,9 @@ int romfile_loader_execute(const char *name)
 
     /* (over)estimate the number of files to load. */
     nfiles = size / sizeof(*entry);
-    files = malloc_tmp(sizeof(*files) + nfiles * sizeof(files->files[0]));
+    files = arena_alloc(&arena
+                        , sizeof(*files) + nfiles * sizeof(files->files[0])
+                        , MALLOC_MIN_ALIGN);
     if (!files) {
         warn_noalloc();
         goto err;
@@ -249,11 +252,10 @@ int romfile_loader_execute(const char *name)
         }
     }
 
-    free(files);
-    free(data);
+    arena_release(&arena, NULL);
     return 0;
 
 err:
-    free(data);
+    arena_release(&arena, NULL);
     return -1;
 }
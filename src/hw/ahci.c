@@ -32,15 +32,14 @@ static void sata_prep_simple(struct sata_cmd_fis *fis, u8 command)
 }
 
 static void sata_prep_readwrite(struct sata_cmd_fis *fis,
-                                struct disk_op_s *op, int iswrite)
+                                u64 lba, u16 count, int iswrite)
 {
-    u64 lba = op->lba;
     u8 command;
 
     memset_fl(fis, 0, sizeof(*fis));
 
-    if (op->count >= (1<<8) || lba + op->count >= (1<<28)) {
-        fis->sector_count2 = op->count >> 8;
+    if (count >= (1<<8) || lba + count >= (1<<28)) {
+        fis->sector_count2 = count >> 8;
         fis->lba_low2      = lba >> 24;
         fis->lba_mid2      = lba >> 32;
         fis->lba_high2     = lba >> 40;
@@ -53,13 +52,33 @@ static void sata_prep_readwrite(struct sata_cmd_fis *fis,
     }
     fis->feature      = 1; /* dma */
     fis->command      = command;
-    fis->sector_count = op->count;
+    fis->sector_count = count;
     fis->lba_low      = lba;
     fis->lba_mid      = lba >> 8;
     fis->lba_high     = lba >> 16;
     fis->device       = ((lba >> 24) & 0xf) | ATA_CB_DH_LBA;
 }
 
+// native command queueing: the sector count moves to the feature
+// registers and the sector count register carries the tag
+static void sata_prep_fpdma(struct sata_cmd_fis *fis,
+                            u64 lba, u16 count, int tag, int iswrite)
+{
+    memset_fl(fis, 0, sizeof(*fis));
+    fis->command      = (iswrite ? ATA_CMD_WRITE_FPDMA_QUEUED
+                         : ATA_CMD_READ_FPDMA_QUEUED);
+    fis->feature      = count;
+    fis->feature2     = count >> 8;
+    fis->sector_count = tag << 3;
+    fis->lba_low      = lba;
+    fis->lba_mid      = lba >> 8;
+    fis->lba_high     = lba >> 16;
+    fis->lba_low2     = lba >> 24;
+    fis->lba_mid2     = lba >> 32;
+    fis->lba_high2    = lba >> 40;
+    fis->device       = ATA_CB_DH_LBA;
+}
+
 static void sata_prep_atapi(struct sata_cmd_fis *fis, u16 blocksize)
 {
     memset_fl(fis, 0, sizeof(*fis));
@@ -100,31 +119,108 @@ static void ahci_port_writel(struct ahci_ctrl_s *ctrl, u32 pnr, u32 reg, u32 val
     ahci_ctrl_writel(ctrl, ctrl_reg, val);
 }
 
+// Return the command table of the given command slot
+static struct ahci_cmd_s *
+ahci_slot_cmd(struct ahci_port_s *port_gf, int slot)
+{
+    return (void*)port_gf->cmd + slot * AHCI_CMD_SIZE;
+}
+
+// Describe a buffer in the prd table of a command, returns the number
+// of entries used.  The buffer must be word aligned.
+static int
+ahci_fill_prdt(struct ahci_cmd_s *cmd, void *buffer, u32 bsize)
+{
+    int prds = 0;
+    while (bsize && prds < AHCI_MAX_PRDS) {
+        u32 len = bsize < AHCI_PRD_MAX_BYTES ? bsize : AHCI_PRD_MAX_BYTES;
+        cmd->prdt[prds].base  = (u32)buffer;
+        cmd->prdt[prds].baseu = 0;
+        cmd->prdt[prds].res   = 0;
+        cmd->prdt[prds].flags = len - 1;
+        buffer += len;
+        bsize -= len;
+        prds++;
+    }
+    if (bsize)
+        dprintf(1, "AHCI: %d bytes do not fit into prd table\n", bsize);
+    return prds;
+}
+
+// Point a command list entry at the command table of its slot
+static void
+ahci_fill_slot(struct ahci_port_s *port_gf, int slot, int prds,
+               int iswrite, int isatapi)
+{
+    struct ahci_list_s *list = port_gf->list;
+    struct ahci_cmd_s *cmd = ahci_slot_cmd(port_gf, slot);
+
+    cmd->fis.reg       = 0x27;
+    cmd->fis.pmp_type  = 1 << 7; /* cmd fis */
+    list[slot].flags  = ((prds << 16) |
+                         (iswrite ? AHCI_CMD_WRITE : 0) |
+                         (isatapi ? AHCI_CMD_ATAPI : 0) |
+                         (5 << 0)); /* fis length (dwords) */
+    list[slot].bytes  = 0;
+    list[slot].base   = (u32)(cmd);
+    list[slot].baseu  = 0;
+}
+
+// non-queued error recovery (AHCI 1.3 section 6.2.2.1)
+static void
+ahci_port_recover(struct ahci_ctrl_s *ctrl, u32 pnr)
+{
+    u32 val;
+
+    // Clears PxCMD.ST to 0 to reset the PxCI register
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+
+    // waits for PxCMD.CR to clear to 0
+    while (1) {
+        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if ((val & PORT_CMD_LIST_ON) == 0)
+            break;
+        yield();
+    }
+
+    // Clears any error bits in PxSERR to enable capturing new errors
+    val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+    // Clears status bits in PxIS as appropriate
+    val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+
+    // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
+    // a COMRESET to the device to put it in an idle state
+    val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
+        dprintf(2, "AHCI/%d: issue comreset\n", pnr);
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
+        mdelay (1);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+    }
+
+    // Sets PxCMD.ST to 1 to enable issuing new commands
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+}
+
 // submit ahci command + wait for result
 static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
                         void *buffer, u32 bsize)
 {
-    u32 val, status, success, flags, intbits, error;
+    u32 status, success, intbits, error;
     struct ahci_ctrl_s *ctrl = port_gf->ctrl;
     struct ahci_cmd_s  *cmd  = port_gf->cmd;
     struct ahci_fis_s  *fis  = port_gf->fis;
-    struct ahci_list_s *list = port_gf->list;
     u32 pnr                  = port_gf->pnr;
 
-    cmd->fis.reg       = 0x27;
-    cmd->fis.pmp_type  = 1 << 7; /* cmd fis */
-    cmd->prdt[0].base  = (u32)buffer;
-    cmd->prdt[0].baseu = 0;
-    cmd->prdt[0].flags = bsize-1;
-
-    flags = ((1 << 16) | /* one prd entry */
-             (iswrite ? (1 << 6) : 0) |
-             (isatapi ? (1 << 5) : 0) |
-             (5 << 0)); /* fis length (dwords) */
-    list[0].flags  = flags;
-    list[0].bytes  = 0;
-    list[0].base   = (u32)(cmd);
-    list[0].baseu  = 0;
+    int prds = ahci_fill_prdt(cmd, buffer, bsize);
+    ahci_fill_slot(port_gf, 0, prds, iswrite, isatapi);
 
     dprintf(8, "AHCI/%d: send cmd ...\n", pnr);
     intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
@@ -169,45 +265,57 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
     } else {
         dprintf(2, "AHCI/%d: ... finished, status 0x%x, ERROR 0x%x\n", pnr,
                 status, error);
+        ahci_port_recover(ctrl, pnr);
+    }
+    return success ? 0 : -1;
+}
 
-        // non-queued error recovery (AHCI 1.3 section 6.2.2.1)
-        // Clears PxCMD.ST to 0 to reset the PxCI register
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
-
-        // waits for PxCMD.CR to clear to 0
-        while (1) {
-            val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-            if ((val & PORT_CMD_LIST_ON) == 0)
-                break;
-            yield();
-        }
+#define AHCI_IRQ_FAIL (PORT_IRQ_TF_ERR | PORT_IRQ_HBUS_ERR |    \
+                       PORT_IRQ_HBUS_DATA_ERR | PORT_IRQ_IF_ERR)
 
-        // Clears any error bits in PxSERR to enable capturing new errors
-        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
-        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+// Issue the commands prepared in slots 0..count-1 at once and wait
+// until the controller has completed all of them.
+static int
+ahci_issue_slots(struct ahci_port_s *port_gf, int count)
+{
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr = port_gf->pnr;
+    u32 mask = (1 << count) - 1;
+    int ncq = port_gf->ncq;
 
-        // Clears status bits in PxIS as appropriate
-        val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+    u32 intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    if (intbits)
+        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    if (ncq)
+        ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, mask);
+    ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, mask);
 
-        // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
-        // a COMRESET to the device to put it in an idle state
-        val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-        if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
-            dprintf(2, "AHCI/%d: issue comreset\n", pnr);
-            val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
-            // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
-            mdelay (1);
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+    u32 end = timer_calc(AHCI_REQUEST_TIMEOUT);
+    for (;;) {
+        intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        if (intbits)
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+        if (intbits & AHCI_IRQ_FAIL)
+            break;
+        u32 busy = ahci_port_readl(ctrl, pnr, PORT_CMD_ISSUE);
+        if (ncq)
+            busy |= ahci_port_readl(ctrl, pnr, PORT_SCR_ACT);
+        if (!(busy & mask)) {
+            u32 tf = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+            if (tf & (ATA_CB_STAT_DF | ATA_CB_STAT_ERR))
+                break;
+            return 0;
         }
-
-        // Sets PxCMD.ST to 1 to enable issuing new commands
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+        if (timer_check(end)) {
+            warn_timeout();
+            break;
+        }
+        yield();
     }
-    return success ? 0 : -1;
+    dprintf(2, "AHCI/%d: ... %d cmds failed, intbits 0x%x, tf 0x%x\n"
+            , pnr, count, intbits, ahci_port_readl(ctrl, pnr, PORT_TFDATA));
+    ahci_port_recover(ctrl, pnr);
+    return -1;
 }
 
 #define CDROM_CDB_SIZE 12
@@ -233,20 +341,44 @@ int ahci_atapi_process_op(struct disk_op_s *op)
     return DISK_RET_SUCCESS;
 }
 
+// Smallest request worth splitting across several command slots
+#define AHCI_MIN_SPLIT 32
+
 // read/write count blocks from a harddrive, op->buf_fl must be word aligned
 static int
 ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
 {
     struct ahci_port_s *port_gf = container_of(
         op->drive_gf, struct ahci_port_s, drive);
-    struct ahci_cmd_s *cmd = port_gf->cmd;
-    int rc;
+    int ncq = port_gf->ncq;
 
-    sata_prep_readwrite(&cmd->fis, op, iswrite);
-    rc = ahci_command(port_gf, iswrite, 0, op->buf_fl,
-                      op->count * DISK_SECTOR_SIZE);
-    dprintf(8, "ahci disk %s, lba %6x, count %3x, buf %p, rc %d\n",
-            iswrite ? "write" : "read", (u32)op->lba, op->count, op->buf_fl, rc);
+    // Spread the request over the available command slots so that a
+    // queueing device can work on all the pieces in parallel.
+    u32 per = DIV_ROUND_UP(op->count, port_gf->slots);
+    if (per < AHCI_MIN_SPLIT)
+        per = AHCI_MIN_SPLIT;
+    u64 lba = op->lba;
+    void *buf = op->buf_fl;
+    u32 left = op->count;
+    int slot = 0;
+    while (left) {
+        u32 count = left < per ? left : per;
+        struct ahci_cmd_s *cmd = ahci_slot_cmd(port_gf, slot);
+        if (ncq)
+            sata_prep_fpdma(&cmd->fis, lba, count, slot, iswrite);
+        else
+            sata_prep_readwrite(&cmd->fis, lba, count, iswrite);
+        int prds = ahci_fill_prdt(cmd, buf, count * DISK_SECTOR_SIZE);
+        ahci_fill_slot(port_gf, slot, prds, iswrite, 0);
+        lba += count;
+        buf += count * DISK_SECTOR_SIZE;
+        left -= count;
+        slot++;
+    }
+    int rc = ahci_issue_slots(port_gf, slot);
+    dprintf(8, "ahci disk %s, lba %6x, count %3x, buf %p, slots %d, rc %d\n",
+            iswrite ? "write" : "read", (u32)op->lba, op->count, op->buf_fl,
+            slot, rc);
     if (rc < 0)
         return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
@@ -260,35 +392,31 @@ ahci_disk_readwrite(struct disk_op_s *op, int iswrite)
     if (((u32) op->buf_fl & 1) == 0)
         return ahci_disk_readwrite_aligned(op, iswrite);
 
-    // Use a word aligned buffer for AHCI I/O
+    // Use a word aligned buffer for AHCI I/O, as many sectors at a
+    // time as fit into the bounce buffer.
     int rc;
     struct disk_op_s localop = *op;
     u8 *alignedbuf_fl = bounce_buf_fl;
     u8 *position = op->buf_fl;
+    u16 left = op->count;
 
     localop.buf_fl = alignedbuf_fl;
-    localop.count = 1;
-
-    if (iswrite) {
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            memcpy_fl (alignedbuf_fl, position, DISK_SECTOR_SIZE);
-            rc = ahci_disk_readwrite_aligned (&localop, 1);
-            if (rc)
-                return rc;
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
-    } else { // read
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            rc = ahci_disk_readwrite_aligned (&localop, 0);
-            if (rc)
-                return rc;
-            memcpy_fl (position, alignedbuf_fl, DISK_SECTOR_SIZE);
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
+    disk_stats_bounce(op);
+    while (left) {
+        localop.count = left;
+        if (localop.count > CDROM_SECTOR_SIZE / DISK_SECTOR_SIZE)
+            localop.count = CDROM_SECTOR_SIZE / DISK_SECTOR_SIZE;
+        u32 bytes = localop.count * DISK_SECTOR_SIZE;
+        if (iswrite)
+            memcpy_fl(alignedbuf_fl, position, bytes);
+        rc = ahci_disk_readwrite_aligned(&localop, iswrite);
+        if (rc)
+            return rc;
+        if (!iswrite)
+            memcpy_fl(position, alignedbuf_fl, bytes);
+        position += bytes;
+        localop.lba += localop.count;
+        left -= localop.count;
     }
     return DISK_RET_SUCCESS;
 }
@@ -350,14 +478,16 @@ ahci_port_alloc(struct ahci_ctrl_s *ctrl, u32 pnr)
     port->ctrl = ctrl;
     port->list = memalign_tmp(1024, 1024);
     port->fis = memalign_tmp(256, 256);
-    port->cmd = memalign_tmp(256, 256);
+    port->cmd = memalign_tmp(AHCI_CMD_SIZE, AHCI_CMD_SIZE);
+    port->slots = 1;
+    port->ncq = 0;
     if (port->list == NULL || port->fis == NULL || port->cmd == NULL) {
         warn_noalloc();
         return NULL;
     }
     memset(port->list, 0, 1024);
     memset(port->fis, 0, 256);
-    memset(port->cmd, 0, 256);
+    memset(port->cmd, 0, AHCI_CMD_SIZE);
 
     ahci_port_writel(ctrl, pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(ctrl, pnr, PORT_FIS_ADDR, (u32)port->fis);
@@ -400,7 +530,7 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
     free(port->cmd);
     port->list = memalign_high(1024, 1024);
     port->fis = memalign_high(256, 256);
-    port->cmd = memalign_high(256, 256);
+    port->cmd = memalign_high(AHCI_CMD_SIZE, AHCI_CMD_SIZE * port->slots);
     if (!port->list || !port->fis || !port->cmd) {
         warn_noalloc();
         free(port->list);
@@ -577,6 +707,19 @@ static int ahci_port_setup(struct ahci_port_s *port)
         if (rc < 0) {
             dprintf(1, "AHCI/%d: Set transfer mode failed.\n", port->pnr);
         }
+
+        // Use several command slots for disk i/o, queued if both the
+        // controller and the drive (word 76 bit 8) support NCQ.
+        int slots = ((ctrl->caps >> 8) & 0x1f) + 1;
+        if ((ctrl->caps & HOST_CAP_NCQ) && (buffer[76] & (1 << 8))) {
+            port->ncq = 1;
+            int depth = (buffer[75] & 0x1f) + 1; // word 75 - queue depth
+            if (slots > depth)
+                slots = depth;
+        }
+        port->slots = slots < AHCI_MAX_SLOTS ? slots : AHCI_MAX_SLOTS;
+        dprintf(2, "AHCI/%d: %d command slots, ncq %d\n",
+                port->pnr, port->slots, port->ncq);
     } else {
         // found cdrom (atapi)
         port->drive.type = DTYPE_AHCI_ATAPI;
@@ -36,6 +36,7 @@ struct ahci_ctrl_s {
     u32 ports;
 };
 
+/* command table, one per command slot */
 struct ahci_cmd_s {
     struct sata_cmd_fis fis;
     u8 atapi[0x20];
@@ -74,17 +75,24 @@ struct ahci_port_s {
     struct ahci_ctrl_s *ctrl;
     struct ahci_list_s *list;
     struct ahci_fis_s  *fis;
-    struct ahci_cmd_s  *cmd;
+    struct ahci_cmd_s  *cmd;   /* 'slots' command tables, AHCI_CMD_SIZE each */
     u32                pnr;
     u32                atapi;
     char               *desc;
     int                prio;
+    u8                 slots;  /* command slots used for disk i/o */
+    u8                 ncq;    /* use READ/WRITE FPDMA QUEUED */
 };
 
 void ahci_setup(void);
 int ahci_process_op(struct disk_op_s *op);
 int ahci_atapi_process_op(struct disk_op_s *op);
 
+#define AHCI_CMD_SIZE             256 /* command table incl. prd table */
+#define AHCI_MAX_PRDS             ((AHCI_CMD_SIZE - 0x80) / 16)
+#define AHCI_PRD_MAX_BYTES        (4 * 1024 * 1024)
+#define AHCI_MAX_SLOTS            4   /* slots used per port for disk i/o */
+
 #define AHCI_IRQ_ON_SG            (1 << 31)
 #define AHCI_CMD_ATAPI            (1 << 5)
 #define AHCI_CMD_WRITE            (1 << 6)
@@ -16,6 +16,7 @@
 #include "pcidevice.h" // foreachpci
 #include "pci_ids.h" // PCI_CLASS_STORAGE_OTHER
 #include "pci_regs.h" // PCI_INTERRUPT_LINE
+#include "fw/paravirt.h" // runningOnQEMU
 #include "pic.h" // enable_hwirq
 #include "stacks.h" // yield
 #include "std/disk.h" // DISK_RET_SUCCESS
@@ -189,8 +190,9 @@ send_cmd(struct atadrive_s *adrive_gf, struct ata_pio_command *cmd)
             return status;
     }
 
-    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA)_EXT commands.
-    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT) {
+    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA|MULTIPLE)_EXT commands.
+    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT
+        || (cmd->command & ~0x10) == ATA_CMD_READ_MULTIPLE_EXT) {
         outb(cmd->feature2, iobase1 + ATA_CB_FR);
         outb(cmd->sector_count2, iobase1 + ATA_CB_SC);
         outb(cmd->lba_low2, iobase1 + ATA_CB_SN);
@@ -271,9 +273,9 @@ fail:
  ****************************************************************/
 
 // Transfer 'op->count' blocks (of 'blocksize' bytes) to/from drive
-// 'op->drive_gf'.
+// 'op->drive_gf'.  The drive signals DRQ once for every 'multi' blocks.
 static int
-ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
+ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize, int multi)
 {
     dprintf(16, "ata_pio_transfer id=%p write=%d count=%d bs=%d buf=%p\n"
             , op->drive_gf, iswrite, op->count, blocksize, op->buf_fl);
@@ -283,26 +285,29 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
     struct ata_channel_s *chan_gf = GET_GLOBALFLAT(adrive_gf->chan_gf);
     u16 iobase1 = GET_GLOBALFLAT(chan_gf->iobase1);
     u16 iobase2 = GET_GLOBALFLAT(chan_gf->iobase2);
+    int pio32 = CONFIG_ATA_PIO32 || GET_GLOBALFLAT(chan_gf->pio32);
     int count = op->count;
     void *buf_fl = op->buf_fl;
     int status;
     for (;;) {
+        int blocks = count < multi ? count : multi;
+        u32 bytes = blocks * blocksize;
         if (iswrite) {
             // Write data to controller
             dprintf(16, "Write sector id=%p dest=%p\n", op->drive_gf, buf_fl);
-            if (CONFIG_ATA_PIO32)
-                outsl_fl(iobase1, buf_fl, blocksize / 4);
+            if (pio32)
+                outsl_fl(iobase1, buf_fl, bytes / 4);
             else
-                outsw_fl(iobase1, buf_fl, blocksize / 2);
+                outsw_fl(iobase1, buf_fl, bytes / 2);
         } else {
             // Read data from controller
             dprintf(16, "Read sector id=%p dest=%p\n", op->drive_gf, buf_fl);
-            if (CONFIG_ATA_PIO32)
-                insl_fl(iobase1, buf_fl, blocksize / 4);
+            if (pio32)
+                insl_fl(iobase1, buf_fl, bytes / 4);
             else
-                insw_fl(iobase1, buf_fl, blocksize / 2);
+                insw_fl(iobase1, buf_fl, bytes / 2);
         }
-        buf_fl += blocksize;
+        buf_fl += bytes;
 
         status = pause_await_not_bsy(iobase1, iobase2);
         if (status < 0) {
@@ -311,7 +316,7 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
             return status;
         }
 
-        count--;
+        count -= blocks;
         if (!count)
             break;
         status &= (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ | ATA_CB_STAT_ERR);
@@ -354,6 +359,12 @@ struct sff_dma_prd {
     u32 count;
 };
 
+// A prd table large enough for the largest (64KiB) request, which
+// touches at most two 64KiB regions when it is not aligned.  The table
+// must not cross a 64KiB boundary, so it is allocated size aligned.
+#define ATA_DMA_PRD_MAX 2
+struct sff_dma_prd *AtaDmaPrd VARFSEG;
+
 // Check if DMA available and setup transfer if so.
 static int
 ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
@@ -369,17 +380,17 @@ ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
         op->drive_gf, struct atadrive_s, drive);
     struct ata_channel_s *chan_gf = GET_GLOBALFLAT(adrive_gf->chan_gf);
     u16 iomaster = GET_GLOBALFLAT(chan_gf->iomaster);
-    if (! iomaster)
+    struct sff_dma_prd *origdma = GET_GLOBAL(AtaDmaPrd);
+    if (! iomaster || ! origdma)
         return -1;
     u32 bytes = op->count * blocksize;
     if (! bytes)
         return -1;
 
-    // Build PRD dma structure.
-    struct sff_dma_prd *dma = MAKE_FLATPTR(SEG_LOW, ExtraStack);
-    struct sff_dma_prd *origdma = dma;
+    // Build PRD dma structure - one entry per 64KiB region touched.
+    struct sff_dma_prd *dma = origdma;
     while (bytes) {
-        if (dma >= &origdma[16])
+        if (dma >= &origdma[ATA_DMA_PRD_MAX])
             // Too many descriptors..
             return -1;
         u32 count = bytes;
@@ -389,12 +400,14 @@ ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
 
         SET_LOWFLAT(dma->buf_fl, dest);
         bytes -= count;
+        dest += count;
+        // A byte count of zero means 64KiB.
+        u32 flags = count & 0xffff;
         if (!bytes)
             // Last descriptor.
-            count |= 1<<31;
-        dprintf(16, "dma@%p: %08x %08x\n", dma, dest, count);
-        dest += count;
-        SET_LOWFLAT(dma->count, count);
+            flags |= 1<<31;
+        dprintf(16, "dma@%p: %08x %08x\n", dma, dest - count, flags);
+        SET_LOWFLAT(dma->count, flags);
         dma++;
     }
 
@@ -463,7 +476,8 @@ ata_dma_transfer(struct disk_op_s *op)
 
 // Transfer data to harddrive using PIO protocol.
 static int
-ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
+ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd
+                 , int multi)
 {
     struct atadrive_s *adrive_gf = container_of(
         op->drive_gf, struct atadrive_s, drive);
@@ -480,7 +494,7 @@ ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
     ret = ata_wait_data(iobase1);
     if (ret)
         goto fail;
-    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE);
+    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE, multi);
 
 fail:
     // Enable interrupts
@@ -509,6 +523,9 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
     u64 lba = op->lba;
 
     int usepio = ata_try_dma(op, iswrite, DISK_SECTOR_SIZE);
+    struct atadrive_s *adrive_gf = container_of(
+        op->drive_gf, struct atadrive_s, drive);
+    int multi = GET_GLOBALFLAT(adrive_gf->multi);
 
     struct ata_pio_command cmd;
     memset(&cmd, 0, sizeof(cmd));
@@ -520,14 +537,20 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
         cmd.lba_high2 = lba >> 40;
         lba &= 0xffffff;
 
-        if (usepio)
+        if (usepio && multi > 1)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE_EXT
+                           : ATA_CMD_READ_MULTIPLE_EXT);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS_EXT
                            : ATA_CMD_READ_SECTORS_EXT);
         else
             cmd.command = (iswrite ? ATA_CMD_WRITE_DMA_EXT
                            : ATA_CMD_READ_DMA_EXT);
     } else {
-        if (usepio)
+        if (usepio && multi > 1)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE
+                           : ATA_CMD_READ_MULTIPLE);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS
                            : ATA_CMD_READ_SECTORS);
         else
@@ -543,7 +566,7 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
 
     int ret;
     if (usepio)
-        ret = ata_pio_cmd_data(op, iswrite, &cmd);
+        ret = ata_pio_cmd_data(op, iswrite, &cmd, multi > 1 ? multi : 1);
     else
         ret = ata_dma_cmd_data(op, &cmd);
     if (ret)
@@ -643,7 +666,7 @@ ata_atapi_process_op(struct disk_op_s *op)
             goto fail;
         }
 
-        ret = ata_pio_transfer(op, 0, blocksize);
+        ret = ata_pio_transfer(op, 0, blocksize, 1);
     }
 
 fail:
@@ -676,7 +699,7 @@ send_ata_identity(struct atadrive_s *adrive, u16 *buffer, int command)
     memset(&cmd, 0, sizeof(cmd));
     cmd.command = command;
 
-    return ata_pio_cmd_data(&dop, 0, &cmd);
+    return ata_pio_cmd_data(&dop, 0, &cmd, 1);
 }
 
 // Extract the ATA/ATAPI version info.
@@ -787,6 +810,21 @@ init_drive_ata(struct atadrive_s *dummy, u16 *buffer)
     else
         sectors = *(u32*)&buffer[60]; // word 60 and word 61
     adrive->drive.sectors = sectors;
+
+    // Enable READ/WRITE MULTIPLE with the largest block the drive
+    // supports (word 47).
+    u8 multi = buffer[47] & 0xff;
+    if (multi > 1) {
+        struct ata_pio_command cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.command = ATA_CMD_SET_MULTIPLE_MODE;
+        cmd.sector_count = multi;
+        if (ata_cmd_nondata(adrive, &cmd) == 0)
+            adrive->multi = multi;
+        dprintf(3, "ata%d-%d: multiple mode %d\n", adrive->chan_gf->ataid
+                , adrive->slave, adrive->multi);
+    }
+
     u64 adjsize = sectors >> 11;
     char adjprefix = 'M';
     if (adjsize >= (1 << 16)) {
@@ -915,6 +953,23 @@ ata_detect(void *data)
     }
 }
 
+// Check if a controller is known to accept 32bit data port accesses.
+static int
+ata_pio32_ok(struct pci_device *pci)
+{
+    if (runningOnQEMU())
+        return 1;
+    if (!pci || pci->vendor != PCI_VENDOR_ID_INTEL)
+        return 0;
+    switch (pci->device) {
+    case PCI_DEVICE_ID_INTEL_82371SB_1: // PIIX3
+    case PCI_DEVICE_ID_INTEL_82371AB:   // PIIX4
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 // Initialize an ata controller and detect its drives.
 static void
 init_controller(struct pci_device *pci, int chanid, int irq
@@ -934,6 +989,8 @@ init_controller(struct pci_device *pci, int chanid, int irq
     chan_gf->iobase1 = port1;
     chan_gf->iobase2 = port2;
     chan_gf->iomaster = master;
+    // 32bit data port accesses halve the number of PIO transfers.
+    chan_gf->pio32 = ata_pio32_ok(pci);
     dprintf(1, "ATA controller %d at %x/%x/%x (irq %d dev %x)\n"
             , ataid, port1, port2, master, irq, chan_gf->pci_bdf);
     run_thread(ata_detect, chan_gf);
@@ -955,6 +1012,14 @@ init_pciata(struct pci_device *pci, u8 prog_if)
             master = pci_enable_iobar(pci, PCI_BASE_ADDRESS_4);
             pci_enable_busmaster(pci);
         }
+        if (master && !AtaDmaPrd) {
+            AtaDmaPrd = memalign_low(ATA_DMA_PRD_MAX
+                                     * sizeof(struct sff_dma_prd)
+                                     , ATA_DMA_PRD_MAX
+                                     * sizeof(struct sff_dma_prd));
+            if (!AtaDmaPrd)
+                warn_noalloc();
+        }
     }
 
     u32 port1, port2, irq;
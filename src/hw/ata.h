@@ -12,6 +12,7 @@ struct ata_channel_s {
     u8  irq;
     u8  chanid;
     u8  ataid;
+    u8  pio32;      // data port accepts 32bit accesses
     int pci_bdf;
     struct pci_device *pci_tmp;
 };
@@ -20,6 +21,7 @@ struct atadrive_s {
     struct drive_s drive;
     struct ata_channel_s *chan_gf;
     u8 slave;
+    u8 multi;       // sectors per DRQ block for READ/WRITE MULTIPLE
 };
 
 // ata.c
@@ -120,6 +122,8 @@ void ata_setup(void);
 #define ATA_CMD_READ_VERIFY_SECTORS          0x40
 #define ATA_CMD_READ_VERIFY_SECTORS_EXT      0x42
 #define ATA_CMD_FORMAT_TRACK                 0x50
+#define ATA_CMD_READ_FPDMA_QUEUED            0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED           0x61
 #define ATA_CMD_SEEK                         0x70
 #define ATA_CMD_CFA_TRANSLATE_SECTOR         0x87
 #define ATA_CMD_EXECUTE_DEVICE_DIAGNOSTIC    0x90
@@ -118,18 +118,65 @@ init_floppy(int floppyid, int ftype)
     return drive;
 }
 
+// Largest cylinder (both heads) of any detected drive
+static u32 FloppyTrackSize;
+
 static void
 addFloppy(int floppyid, int ftype)
 {
     struct drive_s *drive = init_floppy(floppyid, ftype);
     if (!drive)
         return;
+    u32 tsize = drive->lchs.head * drive->lchs.sector * DISK_SECTOR_SIZE;
+    if (tsize > FloppyTrackSize)
+        FloppyTrackSize = tsize;
     char *desc = znprintf(MAXDESCSIZE, "Floppy [drive %c]", 'A' + floppyid);
     struct pci_device *pci = pci_find_class(PCI_CLASS_BRIDGE_ISA); /* isa-to-pci bridge */
     int prio = bootprio_find_fdc_device(pci, PORT_FD_BASE, floppyid);
     boot_add_floppy(drive, desc, prio);
 }
 
+// Track buffer - reads fetch a whole cylinder (both heads) and later
+// reads of that cylinder are served from memory.
+u8 *FloppyTrackBuf VARFSEG;
+u16 FloppyTrackBufSize VARFSEG;
+u8 FloppyTrackValid VARLOW;
+u8 FloppyTrackDrive VARLOW;
+u8 FloppyTrackCyl VARLOW;
+u8 FloppyTrackDskChg VARLOW;
+u8 FloppyTrackNoCache VARLOW;
+
+static void
+floppy_track_flush(void)
+{
+    if (CONFIG_FLOPPY_TRACK_BUFFER)
+        SET_LOW(FloppyTrackValid, 0);
+}
+
+static void
+floppy_track_setup(void)
+{
+    u32 size = FloppyTrackSize;
+    if (!CONFIG_FLOPPY_TRACK_BUFFER || !size)
+        return;
+    // The ISA DMA controller can't cross a 64KiB boundary - allocate
+    // twice the size, use a part that doesn't cross one, and give the
+    // rest back.
+    u8 *buf = malloc_low(size * 2);
+    if (!buf) {
+        warn_noalloc();
+        return;
+    }
+    u32 offset = 0, boundary = ALIGN((u32)buf, 0x10000);
+    if (boundary < (u32)buf + size)
+        offset = boundary - (u32)buf;
+    malloc_trim(buf, offset, size);
+    buf += offset;
+    dprintf(3, "floppy track buffer at %p (%d bytes)\n", buf, size);
+    FloppyTrackBuf = buf;
+    FloppyTrackBufSize = size;
+}
+
 void
 floppy_setup(void)
 {
@@ -156,6 +203,7 @@ floppy_setup(void)
         if (type)
             addFloppy(1, type);
     }
+    floppy_track_setup();
 
     enable_hwirq(6, FUNC16(entry_0e));
 }
@@ -191,6 +239,7 @@ static void
 floppy_disable_controller(void)
 {
     dprintf(2, "Floppy_disable_controller\n");
+    floppy_track_flush();
     floppy_dor_write(0x00);
 }
 
@@ -360,6 +409,7 @@ floppy_drive_recal(u8 floppyid)
     u8 frs = GET_BDA(floppy_recalibration_status);
     SET_BDA(floppy_recalibration_status, frs | (1<<floppyid));
     SET_BDA(floppy_track[floppyid], 0);
+    floppy_track_flush();
     return DISK_RET_SUCCESS;
 }
 
@@ -420,6 +470,7 @@ floppy_media_sense(struct drive_s *drive_gf)
         < GET_GLOBAL(FloppyInfo[ftype].chs.cylinder))
         fms |= FMS_DOUBLE_STEPPING;
     SET_BDA(floppy_media_state[floppyid], fms);
+    SET_LOW(FloppyTrackNoCache, GET_LOW(FloppyTrackNoCache) & ~(1<<floppyid));
 
     return DISK_RET_SUCCESS;
 }
@@ -464,16 +515,15 @@ floppy_prep(struct drive_s *drive_gf, u8 cylinder)
 
 // Perform a floppy transfer command (setup DMA and issue PIO).
 static int
-floppy_dma_cmd(struct disk_op_s *op, int count, int command, u8 *param)
+floppy_dma_cmd(u8 floppyid, void *buf_fl, int count, int command, u8 *param)
 {
     // Setup DMA controller
     int isWrite = command != FC_READ;
-    int ret = dma_floppy((u32)op->buf_fl, count, isWrite);
+    int ret = dma_floppy((u32)buf_fl, count, isWrite);
     if (ret)
         return DISK_RET_EBOUNDARY;
 
     // Invoke floppy controller
-    u8 floppyid = GET_GLOBALFLAT(op->drive_gf->cntl_id);
     ret = floppy_drive_pio(floppyid, command, param);
     if (ret)
         return ret;
@@ -533,12 +583,87 @@ floppy_reset(struct disk_op_s *op)
     return floppy_enable_controller();
 }
 
+// Check if the disk change line indicates a media change since the
+// track buffer was filled.
+static int
+floppy_track_changed(u8 floppyid)
+{
+    // The change line can only be read for the selected, spinning drive.
+    u8 dor = GET_LOW(FloppyDOR);
+    if ((dor & 0x07) != (0x04 | floppyid) || !(dor & (0x10 << floppyid)))
+        return 1;
+    return (inb(PORT_FD_DIR) & 0x80) && !GET_LOW(FloppyTrackDskChg);
+}
+
+// Serve a read from the track buffer, reading the whole cylinder (both
+// heads) into it first if needed.  Returns -1 if the request can not use
+// the track buffer.
+static int
+floppy_track_read(struct disk_op_s *op, struct chs_s chs)
+{
+    u8 *buf_fl = GET_GLOBAL(FloppyTrackBuf);
+    if (!CONFIG_FLOPPY_TRACK_BUFFER || !buf_fl)
+        return -1;
+    u8 floppyid = GET_GLOBALFLAT(op->drive_gf->cntl_id);
+    u16 nls = GET_GLOBALFLAT(op->drive_gf->lchs.sector);
+    u16 nlh = GET_GLOBALFLAT(op->drive_gf->lchs.head);
+    u32 size = nlh * nls * DISK_SECTOR_SIZE;
+    u32 first = chs.head * nls + chs.sector - 1;
+    if (size > GET_GLOBAL(FloppyTrackBufSize) || first + op->count > nlh * nls
+        || GET_LOW(FloppyTrackNoCache) & (1<<floppyid))
+        return -1;
+
+    if (!GET_LOW(FloppyTrackValid) || GET_LOW(FloppyTrackDrive) != floppyid
+        || GET_LOW(FloppyTrackCyl) != chs.cylinder
+        || floppy_track_changed(floppyid)) {
+        SET_LOW(FloppyTrackValid, 0);
+        int ret = floppy_prep(op->drive_gf, chs.cylinder);
+        if (ret)
+            return ret;
+
+        // Multi-track read starting at head 0 continues on head 1
+        u8 param[8];
+        param[0] = floppyid; // HD DR1 DR2
+        param[1] = chs.cylinder;
+        param[2] = 0;
+        param[3] = 1;
+        param[4] = FLOPPY_SIZE_CODE;
+        param[5] = nls; // last sector to read on track
+        param[6] = FLOPPY_GAPLEN;
+        param[7] = FLOPPY_DATALEN;
+        ret = floppy_dma_cmd(floppyid, buf_fl, size, FC_READ, param);
+        if (ret) {
+            // The media may have fewer sectors than the drive - don't
+            // use the track buffer until the next media sense.
+            dprintf(3, "floppy track read failed (drive %d cyl %d)\n"
+                    , floppyid, chs.cylinder);
+            SET_LOW(FloppyTrackNoCache
+                    , GET_LOW(FloppyTrackNoCache) | (1<<floppyid));
+            return -1;
+        }
+        SET_LOW(FloppyTrackDrive, floppyid);
+        SET_LOW(FloppyTrackCyl, chs.cylinder);
+        SET_LOW(FloppyTrackDskChg, inb(PORT_FD_DIR) & 0x80);
+        SET_LOW(FloppyTrackValid, 1);
+    }
+
+    // reset the disk motor timeout value of INT 08
+    SET_BDA(floppy_motor_counter, FLOPPY_MOTOR_TICKS);
+    memcpy_fl(op->buf_fl, buf_fl + first * DISK_SECTOR_SIZE
+              , op->count * DISK_SECTOR_SIZE);
+    return DISK_RET_SUCCESS;
+}
+
 // Read Diskette Sectors
 static int
 floppy_read(struct disk_op_s *op)
 {
     struct chs_s chs = lba2chs(op);
-    int ret = floppy_prep(op->drive_gf, chs.cylinder);
+    int ret = floppy_track_read(op, chs);
+    if (ret >= 0)
+        return ret;
+
+    ret = floppy_prep(op->drive_gf, chs.cylinder);
     if (ret)
         return ret;
 
@@ -553,7 +678,8 @@ floppy_read(struct disk_op_s *op)
     param[5] = chs.sector + op->count - 1; // last sector to read on track
     param[6] = FLOPPY_GAPLEN;
     param[7] = FLOPPY_DATALEN;
-    return floppy_dma_cmd(op, op->count * DISK_SECTOR_SIZE, FC_READ, param);
+    return floppy_dma_cmd(floppyid, op->buf_fl, op->count * DISK_SECTOR_SIZE
+                          , FC_READ, param);
 }
 
 // Write Diskette Sectors
@@ -565,6 +691,8 @@ floppy_write(struct disk_op_s *op)
     if (ret)
         return ret;
 
+    floppy_track_flush();
+
     // send write-normal-data command to controller
     u8 floppyid = GET_GLOBALFLAT(op->drive_gf->cntl_id);
     u8 param[8];
@@ -576,7 +704,8 @@ floppy_write(struct disk_op_s *op)
     param[5] = chs.sector + op->count - 1; // last sector to write on track
     param[6] = FLOPPY_GAPLEN;
     param[7] = FLOPPY_DATALEN;
-    return floppy_dma_cmd(op, op->count * DISK_SECTOR_SIZE, FC_WRITE, param);
+    return floppy_dma_cmd(floppyid, op->buf_fl, op->count * DISK_SECTOR_SIZE
+                          , FC_WRITE, param);
 }
 
 // Verify Diskette Sectors
@@ -601,6 +730,8 @@ floppy_format(struct disk_op_s *op)
     if (ret)
         return ret;
 
+    floppy_track_flush();
+
     // send format-track command to controller
     u8 floppyid = GET_GLOBALFLAT(op->drive_gf->cntl_id);
     u8 param[7];
@@ -609,7 +740,8 @@ floppy_format(struct disk_op_s *op)
     param[2] = op->count; // number of sectors per track
     param[3] = FLOPPY_FORMAT_GAPLEN;
     param[4] = FLOPPY_FILLBYTE;
-    return floppy_dma_cmd(op, op->count * 4, FC_FORMAT, param);
+    return floppy_dma_cmd(floppyid, op->buf_fl, op->count * 4
+                          , FC_FORMAT, param);
 }
 
 int
@@ -666,8 +798,10 @@ floppy_tick(void)
     if (fcount) {
         fcount--;
         SET_BDA(floppy_motor_counter, fcount);
-        if (fcount == 0)
+        if (fcount == 0) {
             // turn motor(s) off
             floppy_dor_write(GET_LOW(FloppyDOR) & ~0xf0);
+            floppy_track_flush();
+        }
     }
 }
@@ -103,8 +103,13 @@ struct nvme_ctrl {
     u32 ns_count;
     struct nvme_namespace *ns;
 
+    u8 mdts;                    /* max data transfer size (0 = unlimited) */
+
     struct nvme_sq io_sq;
     struct nvme_cq io_cq;
+
+    /* NVME_MAX_INFLIGHT page aligned PRP lists, one per in-flight command. */
+    u64 *prpl;
 };
 
 struct nvme_namespace {
@@ -118,6 +123,9 @@ struct nvme_namespace {
     u32 block_size;
     u32 metadata_size;
 
+    /* Maximum number of blocks a single I/O command may transfer. */
+    u16 max_req_size;
+
     /* Page aligned buffer of size NVME_PAGE_SIZE. */
     char *dma_buffer;
 };
@@ -130,8 +138,12 @@ struct nvme_identify_ctrl {
     char sn[20];
     char mn[40];
     char fr[8];
+    u8  rab;
+    u8  ieee[3];
+    u8  cmic;
+    u8  mdts;                   /* max data transfer size, 2^n pages */
 
-    char _boring[516 - 72];
+    char _boring[516 - 78];
 
     u32 nn;                     /* number of namespaces */
 };
@@ -190,6 +202,12 @@ union nvme_identify {
 
 #define NVME_PAGE_SIZE 4096
 
+/* Number of PRP entries that fit into a single PRP list page. */
+#define NVME_MAX_PRPL_ENTRIES (NVME_PAGE_SIZE / sizeof(u64))
+
+/* Number of I/O commands submitted to the I/O queue before waiting. */
+#define NVME_MAX_INFLIGHT 4
+
 /* Length for the queue entries. */
 #define NVME_SQE_SIZE_LOG 6
 #define NVME_CQE_SIZE_LOG 4
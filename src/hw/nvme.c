@@ -142,7 +142,7 @@ nvme_wait(struct nvme_sq *sq)
 static struct nvme_sqe *
 nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
 {
-    if (((sq->head + 1) & sq->common.mask) == sq->tail) {
+    if (((sq->tail + 1) & sq->common.mask) == sq->head) {
         dprintf(3, "submission queue is full");
         return NULL;
     }
@@ -155,23 +155,37 @@ nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
     sqe->mptr = (u32)metadata;
     sqe->dptr_prp1 = (u32)data;
 
-    if (sqe->dptr_prp1 & (NVME_PAGE_SIZE - 1)) {
-        /* Data buffer not page aligned. */
+    if (sqe->dptr_prp1 & 0x3) {
+        /* PRP entries have to be dword aligned. */
         warn_internalerror();
     }
 
     return sqe;
 }
 
-/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+/* Hands the sqe from nvme_get_next_sqe over to the queue, without telling the
+   controller yet. Use nvme_ring_sq to submit all queued entries. */
 static void
-nvme_commit_sqe(struct nvme_sq *sq)
+nvme_queue_sqe(struct nvme_sq *sq)
 {
-    dprintf(4, "sq %p commit_sqe %u\n", sq, sq->tail);
+    dprintf(4, "sq %p queue_sqe %u\n", sq, sq->tail);
     sq->tail = (sq->tail + 1) & sq->common.mask;
+}
+
+static void
+nvme_ring_sq(struct nvme_sq *sq)
+{
     writel(sq->common.dbl, sq->tail);
 }
 
+/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+static void
+nvme_commit_sqe(struct nvme_sq *sq)
+{
+    nvme_queue_sqe(sq);
+    nvme_ring_sq(sq);
+}
+
 /* Perform an identify command on the admin queue and return the resulting
    buffer. This may be a NULL pointer, if something failed. This function
    cannot be used after initialization, because it uses buffers in tmp zone. */
@@ -263,6 +277,13 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
         goto free_buffer;
     }
 
+    /* A single command can describe PRP1 plus one page of PRP list entries,
+       unless the controller advertises a smaller transfer limit. */
+    u32 max_bytes = NVME_MAX_PRPL_ENTRIES * NVME_PAGE_SIZE;
+    if (ctrl->mdts && (1U << ctrl->mdts) < NVME_MAX_PRPL_ENTRIES)
+        max_bytes = NVME_PAGE_SIZE << ctrl->mdts;
+    ns->max_req_size = max_bytes / ns->block_size;
+
     ns->drive.cntl_id   = ns - ctrl->ns;
     ns->drive.removable = 0;
     ns->drive.type      = DTYPE_NVME;
@@ -270,6 +291,10 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
     ns->drive.sectors   = ns->lba_count;
 
     ns->dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+    if (!ns->dma_buffer) {
+        warn_noalloc();
+        goto free_buffer;
+    }
 
     char *desc = znprintf(MAXDESCSIZE, "NVMe NS %u: %llu MiB (%llu %u-byte "
                           "blocks + %u-byte metadata)\n",
@@ -346,45 +371,96 @@ nvme_create_io_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq, u16 q_idx, struct
     return 0;
 }
 
-/* Reads count sectors into buf. Returns DISK_RET_*. The buffer cannot cross
-   page boundaries. */
+/* Fills in the data pointer of sqe for a transfer of size bytes at buf. PRP1
+   may point anywhere into the first page, every following entry points to the
+   start of a page. If more than two pages are touched, PRP2 points to prpl,
+   which receives the list of the remaining pages. */
+static void
+nvme_fill_prps(struct nvme_sqe *sqe, u64 *prpl, u32 buf_addr, u32 size)
+{
+    u32 first = NVME_PAGE_SIZE - (buf_addr & (NVME_PAGE_SIZE - 1));
+
+    sqe->dptr_prp1 = buf_addr;
+    if (size <= first)
+        return;
+
+    u32 page = buf_addr + first;
+    if (size - first <= NVME_PAGE_SIZE) {
+        sqe->dptr_prp2 = page;
+        return;
+    }
+
+    u32 end = buf_addr + size, i = 0;
+    for (; page < end; page += NVME_PAGE_SIZE)
+        prpl[i++] = page;
+    sqe->dptr_prp2 = (u32)prpl;
+}
+
+/* Queues a command transferring count sectors between buf and the device,
+   using prpl as its PRP list. The controller is not notified until the queue
+   is rung. Returns 0 on success. The buffer must be dword aligned and count
+   must not exceed ns->max_req_size. */
 static int
-nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
-                  int write)
+nvme_io_queue(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
+              int write, u64 *prpl)
 {
     u32 buf_addr = (u32)buf;
 
-    if ((buf_addr & 0x3) ||
-        ((buf_addr & ~(NVME_PAGE_SIZE - 1)) !=
-         ((buf_addr + ns->block_size * count - 1) & ~(NVME_PAGE_SIZE - 1)))) {
-        /* Buffer is misaligned or crosses page boundary */
+    if ((buf_addr & 0x3) || count > ns->max_req_size) {
+        /* Buffer is misaligned or too large for a single PRP list */
         warn_internalerror();
-        return DISK_RET_EBADTRACK;
+        return -1;
     }
 
     struct nvme_sqe *io_read = nvme_get_next_sqe(&ns->ctrl->io_sq,
                                                  write ? NVME_SQE_OPC_IO_WRITE
                                                        : NVME_SQE_OPC_IO_READ,
                                                  NULL, buf);
+    if (!io_read)
+        return -1;
+    nvme_fill_prps(io_read, prpl, buf_addr, ns->block_size * count);
     io_read->nsid = ns->ns_id;
     io_read->dword[10] = (u32)lba;
     io_read->dword[11] = (u32)(lba >> 32);
     io_read->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
 
-    nvme_commit_sqe(&ns->ctrl->io_sq);
+    nvme_queue_sqe(&ns->ctrl->io_sq);
+    return 0;
+}
+
+/* Waits for count submitted commands to complete. All completions are
+   consumed even if one of them failed, so the queue is empty afterwards.
+   Returns DISK_RET_*. */
+static int
+nvme_io_complete(struct nvme_sq *sq, int count)
+{
+    int res = DISK_RET_SUCCESS;
 
-    struct nvme_cqe cqe = nvme_wait(&ns->ctrl->io_sq);
+    while (count--) {
+        struct nvme_cqe cqe = nvme_wait(sq);
 
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "read io: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+        if (!nvme_is_cqe_success(&cqe)) {
+            dprintf(2, "read io: %08x %08x %08x %08x\n",
+                    cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
 
-        return DISK_RET_EBADTRACK;
+            res = DISK_RET_EBADTRACK;
+        }
     }
 
-    return DISK_RET_SUCCESS;
+    return res;
 }
 
+/* Transfers count sectors with a single command. Returns DISK_RET_*. */
+static int
+nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
+                  int write)
+{
+    if (nvme_io_queue(ns, lba, buf, count, write, ns->ctrl->prpl))
+        return DISK_RET_EBADTRACK;
+
+    nvme_ring_sq(&ns->ctrl->io_sq);
+    return nvme_io_complete(&ns->ctrl->io_sq, 1);
+}
 
 static int
 nvme_create_io_queues(struct nvme_ctrl *ctrl)
@@ -395,6 +471,13 @@ nvme_create_io_queues(struct nvme_ctrl *ctrl)
     if (nvme_create_io_sq(ctrl, &ctrl->io_sq, 2, &ctrl->io_cq))
         return -1;
 
+    ctrl->prpl = zalloc_page_aligned(&ZoneHigh,
+                                     NVME_PAGE_SIZE * NVME_MAX_INFLIGHT);
+    if (!ctrl->prpl) {
+        warn_noalloc();
+        return -1;
+    }
+
     return 0;
 }
 
@@ -478,6 +561,7 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
             identify->nn, (identify->nn == 1) ? "" : "s");
 
     ctrl->ns_count = identify->nn;
+    ctrl->mdts = identify->mdts;
     free(identify);
 
     if ((ctrl->ns_count == 0) || nvme_create_io_queues(ctrl)) {
@@ -564,13 +648,16 @@ nvme_scan(void)
     }
 }
 
+/* Transfers an unaligned buffer through dma_buffer, one page at a time. */
 static int
-nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+nvme_bounce_readwrite(struct nvme_namespace *ns, struct disk_op_s *op,
+                      int write)
 {
     int res = DISK_RET_SUCCESS;
     u16 const max_blocks = NVME_PAGE_SIZE / ns->block_size;
     u16 i;
 
+    disk_stats_bounce(op);
     for (i = 0; i < op->count && res == DISK_RET_SUCCESS;) {
         u16 blocks_remaining = op->count - i;
         u16 blocks = blocks_remaining < max_blocks ? blocks_remaining
@@ -596,6 +683,48 @@ nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
     return res;
 }
 
+static int
+nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+{
+    /* PRP entries only need dword alignment, so nearly every caller buffer
+       can be handed to the controller directly. */
+    if ((u32)op->buf_fl & 0x3)
+        return nvme_bounce_readwrite(ns, op, write);
+
+    struct nvme_ctrl *ctrl = ns->ctrl;
+    int res = DISK_RET_SUCCESS;
+    u16 i;
+
+    for (i = 0; i < op->count && res == DISK_RET_SUCCESS;) {
+        /* Queue up to NVME_MAX_INFLIGHT commands, ring the doorbell once and
+           then collect all their completions. */
+        int inflight = 0;
+        while (i < op->count && inflight < NVME_MAX_INFLIGHT) {
+            u16 blocks_remaining = op->count - i;
+            u16 blocks = blocks_remaining < ns->max_req_size
+                ? blocks_remaining : ns->max_req_size;
+            u64 *prpl = &ctrl->prpl[inflight * NVME_MAX_PRPL_ENTRIES];
+
+            if (nvme_io_queue(ns, op->lba + i, op->buf_fl + i * ns->block_size,
+                              blocks, write, prpl))
+                break;
+            dprintf(3, "ns %u %s lba %llu+%u queued\n", ns->ns_id,
+                    write ? "write" : "read", op->lba + i, blocks);
+
+            inflight++;
+            i += blocks;
+        }
+
+        if (!inflight)
+            return DISK_RET_EBADTRACK;
+
+        nvme_ring_sq(&ctrl->io_sq);
+        res = nvme_io_complete(&ctrl->io_sq, inflight);
+    }
+
+    return res;
+}
+
 int
 nvme_process_op(struct disk_op_s *op)
 {
@@ -27,6 +27,11 @@
 
 #define SIMPLE_QUEUE_TAG 0x20
 
+/* Request ring entries used at once for one disk_op_s */
+#define PVSCSI_MAX_REQS  8
+/* Smallest per-entry sector count worth splitting a request into */
+#define PVSCSI_MIN_SPLIT 64
+
 #define PVSCSI_INTR_CMPL_0                 (1 << 0)
 #define PVSCSI_INTR_CMPL_1                 (1 << 1)
 #define PVSCSI_INTR_CMPL_MASK              MASK(2)
@@ -154,14 +159,6 @@ pvscsi_kick_rw_io(void *iobase)
     writel(iobase + PVSCSI_REG_OFFSET_KICK_RW_IO, 0);
 }
 
-static void
-pvscsi_wait_intr_cmpl(void *iobase)
-{
-    while (!(readl(iobase + PVSCSI_REG_OFFSET_INTR_STATUS) & PVSCSI_INTR_CMPL_MASK))
-        usleep(5);
-    writel(iobase + PVSCSI_REG_OFFSET_INTR_STATUS, PVSCSI_INTR_CMPL_MASK);
-}
-
 static void
 pvscsi_init_rings(void *iobase, struct pvscsi_ring_dsc_s **ring_dsc)
 {
@@ -207,31 +204,21 @@ pvscsi_get_rsp(struct PVSCSIRingsState *s,
     return status;
 }
 
-int
-pvscsi_process_op(struct disk_op_s *op)
+// Fill in the next free request ring entry for 'op'.  Returns the block
+// size of the command or a negative value if it can not be sent.
+static int
+pvscsi_fill_req(struct pvscsi_lun_s *plun, struct disk_op_s *op, u64 context)
 {
-    if (!CONFIG_PVSCSI)
-        return DISK_RET_EBADTRACK;
-    struct pvscsi_lun_s *plun =
-        container_of(op->drive_gf, struct pvscsi_lun_s, drive);
     struct pvscsi_ring_dsc_s *ring_dsc = plun->ring_dsc;
     struct PVSCSIRingsState *s = ring_dsc->ring_state;
     u32 req_entries = s->reqNumEntriesLog2;
-    u32 cmp_entries = s->cmpNumEntriesLog2;
     struct PVSCSIRingReqDesc *req;
-    struct PVSCSIRingCmpDesc *rsp;
-    u32 status;
-
-    if (s->reqProdIdx - s->cmpConsIdx >= 1 << req_entries) {
-        dprintf(1, "pvscsi: ring full: reqProdIdx=%d cmpConsIdx=%d\n",
-                s->reqProdIdx, s->cmpConsIdx);
-        return DISK_RET_EBADTRACK;
-    }
 
     req = ring_dsc->ring_reqs + (s->reqProdIdx & MASK(req_entries));
     int blocksize = scsi_fill_cmd(op, req->cdb, 16);
     if (blocksize < 0)
-        return default_process_op(op);
+        return blocksize;
+    req->context = context;
     req->bus = 0;
     req->target = plun->target;
     memset(req->lun, 0, sizeof(req->lun));
@@ -246,14 +233,94 @@ pvscsi_process_op(struct disk_op_s *op)
     req->dataLen = op->count * blocksize;
     req->dataAddr = (u32)op->buf_fl;
     s->reqProdIdx = s->reqProdIdx + 1;
+    return blocksize;
+}
 
-    pvscsi_kick_rw_io(plun->iobase);
-    pvscsi_wait_intr_cmpl(plun->iobase);
+// Wait for 'count' completions and consume them from the completion ring.
+static int
+pvscsi_drain_cmps(struct pvscsi_lun_s *plun, int count)
+{
+    struct pvscsi_ring_dsc_s *ring_dsc = plun->ring_dsc;
+    struct PVSCSIRingsState *s = ring_dsc->ring_state;
+    u32 cmp_entries = s->cmpNumEntriesLog2;
+    int ret = DISK_RET_SUCCESS;
+
+    while (count) {
+        while (readl(&s->cmpProdIdx) == s->cmpConsIdx)
+            usleep(5);
+        while (count && readl(&s->cmpProdIdx) != s->cmpConsIdx) {
+            struct PVSCSIRingCmpDesc *rsp =
+                ring_dsc->ring_cmps + (s->cmpConsIdx & MASK(cmp_entries));
+            if (pvscsi_get_rsp(s, rsp))
+                ret = DISK_RET_EBADTRACK;
+            count--;
+        }
+    }
+    writel(plun->iobase + PVSCSI_REG_OFFSET_INTR_STATUS, PVSCSI_INTR_CMPL_MASK);
+    return ret;
+}
+
+// Split a read/write over several request ring entries, kick the device
+// once per batch and collect all completions afterwards.
+static int
+pvscsi_rw(struct pvscsi_lun_s *plun, struct disk_op_s *op)
+{
+    struct PVSCSIRingsState *s = plun->ring_dsc->ring_state;
+    u32 ring_size = 1 << s->reqNumEntriesLog2;
+    int nreqs = op->count / PVSCSI_MIN_SPLIT;
+    if (nreqs > PVSCSI_MAX_REQS)
+        nreqs = PVSCSI_MAX_REQS;
+    u32 chunk = DIV_ROUND_UP(op->count, nreqs ?: 1);
+
+    struct disk_op_s sub = *op;
+    u32 remaining = op->count;
+    int ret = DISK_RET_SUCCESS;
+    while (remaining && ret == DISK_RET_SUCCESS) {
+        int num_added = 0;
+        while (remaining && num_added < PVSCSI_MAX_REQS
+               && s->reqProdIdx - s->cmpConsIdx < ring_size) {
+            sub.count = remaining < chunk ? remaining : chunk;
+            int blocksize = pvscsi_fill_req(plun, &sub, num_added);
+            if (blocksize < 0)
+                break;
+            num_added++;
+            sub.lba += sub.count;
+            sub.buf_fl += sub.count * blocksize;
+            remaining -= sub.count;
+        }
+        if (!num_added)
+            return DISK_RET_EBADTRACK;
+
+        pvscsi_kick_rw_io(plun->iobase);
+        ret = pvscsi_drain_cmps(plun, num_added);
+    }
+    return ret;
+}
+
+int
+pvscsi_process_op(struct disk_op_s *op)
+{
+    if (!CONFIG_PVSCSI)
+        return DISK_RET_EBADTRACK;
+    struct pvscsi_lun_s *plun =
+        container_of(op->drive_gf, struct pvscsi_lun_s, drive);
+    struct PVSCSIRingsState *s = plun->ring_dsc->ring_state;
+    u32 req_entries = s->reqNumEntriesLog2;
 
-    rsp = ring_dsc->ring_cmps + (s->cmpConsIdx & MASK(cmp_entries));
-    status = pvscsi_get_rsp(s, rsp);
+    if (s->reqProdIdx - s->cmpConsIdx >= 1 << req_entries) {
+        dprintf(1, "pvscsi: ring full: reqProdIdx=%d cmpConsIdx=%d\n",
+                s->reqProdIdx, s->cmpConsIdx);
+        return DISK_RET_EBADTRACK;
+    }
+
+    if (op->command == CMD_READ || op->command == CMD_WRITE)
+        return pvscsi_rw(plun, op);
 
-    return status == 0 ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    if (pvscsi_fill_req(plun, op, 0) < 0)
+        return default_process_op(op);
+
+    pvscsi_kick_rw_io(plun->iobase);
+    return pvscsi_drain_cmps(plun, 1);
 }
 
 static int
@@ -8,6 +8,7 @@
 #include "block.h" // struct drive_s
 #include "bregs.h" // struct bregs
 #include "e820map.h" // e820_add
+#include "fw/lzmadecode.h" // LzmaDecode
 #include "malloc.h" // memalign_tmphigh
 #include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
@@ -17,6 +18,235 @@
 #include "string.h" // memset
 #include "util.h" // process_ramdisk_op
 
+
+/****************************************************************
+ * Chunked lzma compressed images
+ ****************************************************************/
+
+// A compressed image starts with this header followed by chunk_count+1
+// offsets (from the start of the file) of the compressed chunks.  Each
+// chunk is an lzma stream (5 byte properties, 8 byte size, data) holding
+// chunk_size bytes of the image (the last chunk may be shorter).
+struct ramdisk_lzma_header {
+    u32 magic;
+    u32 size;
+    u32 chunk_size;
+    u32 chunk_count;
+    u32 offsets[0];
+} PACKED;
+
+#define RAMDISK_LZMA_MAGIC 0x315a4452 // "RDZ1"
+#define RAMDISK_LZMA_MAX_CHUNK (64*1024)
+#define RAMDISK_LZMA_CACHE 4
+
+struct ramdisk_lzma_s {
+    struct ramdisk_lzma_header *hdr;
+    CProb *probs;
+    u32 probs_size;
+    u8 *cache;
+    u32 cache_chunk[RAMDISK_LZMA_CACHE];
+    u32 cache_used[RAMDISK_LZMA_CACHE];
+    u32 clock;
+};
+
+// Decompress a chunk of the image into 'dst'.
+static int
+ramdisk_lzma_inflate(struct ramdisk_lzma_s *rdz, u32 chunk, u8 *dst)
+{
+    struct ramdisk_lzma_header *hdr = rdz->hdr;
+    u8 *src = (void*)hdr + hdr->offsets[chunk];
+    u32 srclen = hdr->offsets[chunk+1] - hdr->offsets[chunk];
+    u32 dstlen = hdr->size - chunk * hdr->chunk_size;
+    if (dstlen > hdr->chunk_size)
+        dstlen = hdr->chunk_size;
+
+    CLzmaDecoderState state;
+    int ret = LzmaDecodeProperties(&state.Properties, src, LZMA_PROPERTIES_SIZE);
+    if (ret != LZMA_RESULT_OK
+        || LzmaGetNumProbs(&state.Properties) * sizeof(CProb) > rdz->probs_size)
+        goto fail;
+    state.Probs = rdz->probs;
+    SizeT inProcessed, outProcessed;
+    ret = LzmaDecode(&state, src + LZMA_PROPERTIES_SIZE + 8
+                     , srclen - LZMA_PROPERTIES_SIZE - 8, &inProcessed
+                     , dst, dstlen, &outProcessed);
+    if (ret || outProcessed != dstlen)
+        goto fail;
+    return 0;
+fail:
+    dprintf(1, "ramdisk: unable to decompress chunk %d\n", chunk);
+    return -1;
+}
+
+// Return the decompressed data of a chunk, using the least recently
+// used cache slot if it isn't already cached.
+static u8 *
+ramdisk_lzma_chunk(struct ramdisk_lzma_s *rdz, u32 chunk)
+{
+    int i, slot = 0;
+    for (i=0; i<RAMDISK_LZMA_CACHE; i++) {
+        if (rdz->cache_chunk[i] == chunk) {
+            slot = i;
+            goto found;
+        }
+        if (rdz->cache_used[i] < rdz->cache_used[slot])
+            slot = i;
+    }
+    rdz->cache_chunk[slot] = -1;
+    u8 *data = rdz->cache + slot * rdz->hdr->chunk_size;
+    if (ramdisk_lzma_inflate(rdz, chunk, data))
+        return NULL;
+    rdz->cache_chunk[slot] = chunk;
+found:
+    rdz->cache_used[slot] = ++rdz->clock;
+    return rdz->cache + slot * rdz->hdr->chunk_size;
+}
+
+static int
+ramdisk_lzma_read(struct disk_op_s *op)
+{
+    struct ramdisk_lzma_s *rdz = (void*)op->drive_gf->cntl_id;
+    u32 chunk_size = rdz->hdr->chunk_size;
+    u32 offset = (u32)op->lba * DISK_SECTOR_SIZE;
+    u32 len = op->count * DISK_SECTOR_SIZE;
+    if (op->lba + op->count > rdz->hdr->size / DISK_SECTOR_SIZE)
+        return DISK_RET_EBADTRACK;
+    void *buf = op->buf_fl;
+    while (len) {
+        u8 *data = ramdisk_lzma_chunk(rdz, offset / chunk_size);
+        if (!data)
+            return DISK_RET_EBADTRACK;
+        u32 pos = offset % chunk_size, count = chunk_size - pos;
+        if (count > len)
+            count = len;
+        memcpy(buf, data + pos, count);
+        buf += count;
+        offset += count;
+        len -= count;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+int
+ramdisk_lzma_process_op(struct disk_op_s *op)
+{
+    if (!CONFIG_FLASH_FLOPPY_LZMA)
+        return 0;
+
+    switch (op->command) {
+    case CMD_READ:
+        return ramdisk_lzma_read(op);
+    case CMD_WRITE:
+        return DISK_RET_EWRITEPROTECT;
+    default:
+        return default_process_op(op);
+    }
+}
+
+// Check that the chunk index of a compressed image is sane.
+static int
+ramdisk_lzma_check(struct ramdisk_lzma_header *hdr, u32 filesize)
+{
+    if (filesize < sizeof(*hdr) || hdr->magic != RAMDISK_LZMA_MAGIC)
+        return -1;
+    u32 chunk_size = hdr->chunk_size, count = hdr->chunk_count;
+    if (!chunk_size || chunk_size % DISK_SECTOR_SIZE
+        || chunk_size > RAMDISK_LZMA_MAX_CHUNK
+        || count != DIV_ROUND_UP(hdr->size, chunk_size)
+        || (filesize - sizeof(*hdr)) / sizeof(hdr->offsets[0]) < count + 1)
+        return -1;
+    int i;
+    for (i=0; i<count; i++) {
+        u32 start = hdr->offsets[i], end = hdr->offsets[i+1];
+        if (end > filesize || start > end
+            || end - start < LZMA_PROPERTIES_SIZE + 8)
+            return -1;
+    }
+    return 0;
+}
+
+static void
+ramdisk_lzma_setup(struct romfile_s *file)
+{
+    const char *filename = file->name;
+    u32 size = file->size;
+    if (!CONFIG_FLASH_FLOPPY_LZMA || size < sizeof(struct ramdisk_lzma_header))
+        goto notype;
+
+    // Copy the compressed image into ram.
+    struct ramdisk_lzma_header *hdr = memalign_tmphigh(PAGE_SIZE, size);
+    if (!hdr) {
+        warn_noalloc();
+        return;
+    }
+    int ret = file->copy(file, hdr, size);
+    if (ret < 0 || ramdisk_lzma_check(hdr, size)) {
+        free(hdr);
+        goto notype;
+    }
+    int ftype = find_floppy_type(hdr->size);
+    if (ftype < 0) {
+        free(hdr);
+        goto notype;
+    }
+
+    // Allocate decoder state and chunk cache.
+    CLzmaProperties props;
+    u8 *chunk0 = (void*)hdr + hdr->offsets[0];
+    if (LzmaDecodeProperties(&props, chunk0, LZMA_PROPERTIES_SIZE)
+        != LZMA_RESULT_OK) {
+        dprintf(1, "ramdisk: bad lzma properties in %s\n", filename);
+        free(hdr);
+        return;
+    }
+    // The decoder state and cache can be up to 256KiB in size, so
+    // place them alongside the image rather than in ZoneHigh.
+    struct ramdisk_lzma_s *rdz = malloc_high(sizeof(*rdz));
+    u32 probs_size = LzmaGetNumProbs(&props) * sizeof(CProb);
+    CProb *probs = memalign_tmphigh(PAGE_SIZE, probs_size);
+    u32 cache_size = RAMDISK_LZMA_CACHE * hdr->chunk_size;
+    u8 *cache = memalign_tmphigh(PAGE_SIZE, cache_size);
+    if (!rdz || !probs || !cache) {
+        warn_noalloc();
+        goto fail;
+    }
+    memset(rdz, 0, sizeof(*rdz));
+    rdz->hdr = hdr;
+    rdz->probs = probs;
+    rdz->probs_size = probs_size;
+    rdz->cache = cache;
+    memset(rdz->cache_chunk, 0xff, sizeof(rdz->cache_chunk));
+
+    // Setup driver.
+    struct drive_s *drive = init_floppy((u32)rdz, ftype);
+    if (!drive)
+        goto fail;
+    drive->type = DTYPE_RAMDISK_LZMA;
+    // Only reserve the compressed image and its buffers once in use.
+    e820_add((u32)hdr, size, E820_RESERVED);
+    e820_add((u32)probs, probs_size, E820_RESERVED);
+    e820_add((u32)cache, cache_size, E820_RESERVED);
+    dprintf(1, "Mapping compressed floppy %s (%d chunks of %d bytes)\n"
+            , filename, hdr->chunk_count, hdr->chunk_size);
+    char *desc = znprintf(MAXDESCSIZE, "Ramdisk [%s]", &filename[10]);
+    boot_add_floppy(drive, desc, bootprio_find_named_rom(filename, 0));
+    return;
+
+fail:
+    free(rdz);
+    free(probs);
+    free(cache);
+    free(hdr);
+    return;
+notype:
+    dprintf(3, "No floppy type found for ramdisk size\n");
+}
+
+
+/****************************************************************
+ * Uncompressed images
+ ****************************************************************/
+
 void
 ramdisk_setup(void)
 {
@@ -32,7 +262,7 @@ ramdisk_setup(void)
     dprintf(3, "Found floppy file %s of size %d\n", filename, size);
     int ftype = find_floppy_type(size);
     if (ftype < 0) {
-        dprintf(3, "No floppy type found for ramdisk size\n");
+        ramdisk_lzma_setup(file);
         return;
     }
 
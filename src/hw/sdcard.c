@@ -66,6 +66,8 @@ struct sdhci_s {
 #define SC_SEND_OP_COND         ((1<<8) | SCB_R48o)
 #define SC_ALL_SEND_CID         ((2<<8) | SCB_R136)
 #define SC_SEND_RELATIVE_ADDR   ((3<<8) | SCB_R48)
+#define SC_SWITCH               ((6<<8) | SCB_R48b)
+#define SC_SWITCH_FUNC          ((6<<8) | SCB_R48d)
 #define SC_SELECT_DESELECT_CARD ((7<<8) | SCB_R48b)
 #define SC_SEND_IF_COND         ((8<<8) | SCB_R48)
 #define SC_SEND_EXT_CSD         ((8<<8) | SCB_R48d)
@@ -75,6 +77,7 @@ struct sdhci_s {
 #define SC_WRITE_SINGLE         ((24<<8) | SCB_R48d)
 #define SC_WRITE_MULTIPLE       ((25<<8) | SCB_R48d)
 #define SC_APP_CMD              ((55<<8) | SCB_R48)
+#define SC_APP_SET_BUS_WIDTH ((6<<8) | SCB_R48)
 #define SC_APP_SEND_OP_COND ((41<<8) | SCB_R48o)
 
 // SDHCI irqs
@@ -90,12 +93,21 @@ struct sdhci_s {
 #define SP_CARD_INSERTED (1<<16)
 
 // SDHCI transfer_mode flags
+#define ST_DMA        (1<<0)
 #define ST_BLOCKCOUNT (1<<1)
 #define ST_AUTO_CMD12 (1<<2)
 #define ST_READ       (1<<4)
 #define ST_MULTIPLE   (1<<5)
 
+// SDHCI host_control flags
+#define SHC_4BIT      (1<<1)
+#define SHC_HIGHSPEED (1<<2)
+#define SHC_DMA_MASK  (3<<3)
+#define SHC_ADMA2_32  (2<<3)
+
 // SDHCI capabilities flags
+#define SD_CAPLO_ADMA2           (1<<19)
+#define SD_CAPLO_HIGHSPEED       (1<<21)
 #define SD_CAPLO_V33             (1<<24)
 #define SD_CAPLO_V30             (1<<25)
 #define SD_CAPLO_V18             (1<<26)
@@ -132,23 +144,42 @@ struct sdhci_s {
 #define SDHCI_CLOCK_ON_TIME    1 // 74 clock cycles
 #define SDHCI_POWERUP_TIMEOUT  1000
 #define SDHCI_PIO_TIMEOUT      1000  // XXX - this is just made up
+#define SDHCI_DMA_TIMEOUT      5000
+
+// ADMA2 descriptor (32-bit addressing)
+struct sdhci_adma2_desc {
+    u16 attr;
+    u16 length;
+    u32 addr;
+} PACKED;
+
+#define SAD_VALID (1<<0)
+#define SAD_END   (1<<1)
+#define SAD_TRAN  (2<<4)
+
+#define SDHCI_ADMA_DESCS       32
+#define SDHCI_ADMA_MAX_LEN     (64*1024)
+#define SDHCI_ADMA_MAX_SECTORS (SDHCI_ADMA_DESCS*SDHCI_ADMA_MAX_LEN/DISK_SECTOR_SIZE)
 
 // Internal 'struct drive_s' storage for a detected card
 struct sddrive_s {
     struct drive_s drive;
     struct sdhci_s *regs;
     int card_type;
+    u16 rca;
+    struct sdhci_adma2_desc *adma;
 };
 
 // SD card types
 #define SF_MMC          (1<<0)
 #define SF_HIGHCAPACITY (1<<1)
+#define SF_HIGHSPEED    (1<<2)
 
 // Repeatedly read a u16 register until any bit in a given mask is set
 static int
-sdcard_waitw(u16 *reg, u16 mask)
+sdcard_waitw_timeout(u16 *reg, u16 mask, u32 timeout)
 {
-    u32 end = timer_calc(SDHCI_PIO_TIMEOUT);
+    u32 end = timer_calc(timeout);
     for (;;) {
         u16 v = readw(reg);
         if (v & mask)
@@ -162,6 +193,12 @@ sdcard_waitw(u16 *reg, u16 mask)
     }
 }
 
+static int
+sdcard_waitw(u16 *reg, u16 mask)
+{
+    return sdcard_waitw_timeout(reg, mask, SDHCI_PIO_TIMEOUT);
+}
+
 // Send an sdhci reset
 static int
 sdcard_reset(struct sdhci_s *regs, int flags)
@@ -210,34 +247,64 @@ sdcard_pio(struct sdhci_s *regs, int cmd, u32 *param)
 
 // Send an "app specific" command to the card.
 static int
-sdcard_pio_app(struct sdhci_s *regs, int cmd, u32 *param)
+sdcard_pio_app(struct sdhci_s *regs, u16 rca, int cmd, u32 *param)
 {
-    u32 aparam[4] = {};
+    u32 aparam[4] = { rca << 16 };
     int ret = sdcard_pio(regs, SC_APP_CMD, aparam);
     if (ret)
         return ret;
     return sdcard_pio(regs, cmd, param);
 }
 
-// Send a command to the card which transfers data.
+// Program the block registers and send a data transfer command.
 static int
-sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
-                    , void *data, int count)
+sdcard_start_transfer(struct sddrive_s *drive, int cmd, u32 arg
+                      , int count, int blocksize, u16 tmode)
 {
-    // Send command
-    writew(&drive->regs->block_size, DISK_SECTOR_SIZE);
+    writew(&drive->regs->block_size, blocksize);
     writew(&drive->regs->block_count, count);
-    int isread = cmd != SC_WRITE_SINGLE && cmd != SC_WRITE_MULTIPLE;
-    u16 tmode = ((count > 1 ? ST_MULTIPLE|ST_AUTO_CMD12|ST_BLOCKCOUNT : 0)
-                 | (isread ? ST_READ : 0));
+    if (count > 1)
+        tmode |= ST_MULTIPLE|ST_AUTO_CMD12|ST_BLOCKCOUNT;
+    if (cmd != SC_WRITE_SINGLE && cmd != SC_WRITE_MULTIPLE)
+        tmode |= ST_READ;
     writew(&drive->regs->transfer_mode, tmode);
-    if (!(drive->card_type & SF_HIGHCAPACITY))
-        addr *= DISK_SECTOR_SIZE;
-    u32 param[4] = { addr };
-    int ret = sdcard_pio(drive->regs, cmd, param);
+    u32 param[4] = { arg };
+    return sdcard_pio(drive->regs, cmd, param);
+}
+
+// Wait for the end of a data transfer started with sdcard_start_transfer()
+static int
+sdcard_finish_transfer(struct sddrive_s *drive, u32 timeout)
+{
+    struct sdhci_s *regs = drive->regs;
+    int ret = sdcard_waitw_timeout(&regs->irq_status, SI_TRANS_DONE|SI_ERROR
+                                   , timeout);
+    if (ret < 0)
+        return ret;
+    if (ret & SI_ERROR) {
+        u16 err = readw(&regs->error_irq_status);
+        dprintf(1, "sdcard transfer error (code=%x adma=%x)\n"
+                , err, readb(&regs->adma_error));
+        sdcard_reset(regs, SRF_CMD|SRF_DATA);
+        writew(&regs->error_irq_status, err);
+        writew(&regs->irq_status, ret);
+        return -1;
+    }
+    writew(&regs->irq_status, SI_TRANS_DONE);
+    return 0;
+}
+
+// Send a command to the card which transfers data.
+static int
+sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 arg
+                    , void *data, int count, int blocksize)
+{
+    // Send command
+    int ret = sdcard_start_transfer(drive, cmd, arg, count, blocksize, 0);
     if (ret)
         return ret;
     // Read/write data
+    int isread = cmd != SC_WRITE_SINGLE && cmd != SC_WRITE_MULTIPLE;
     u16 cbit = isread ? SI_READ_READY : SI_WRITE_READY;
     while (count--) {
         ret = sdcard_waitw(&drive->regs->irq_status, cbit);
@@ -245,7 +312,7 @@ sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
             return ret;
         writew(&drive->regs->irq_status, cbit);
         int i;
-        for (i=0; i<DISK_SECTOR_SIZE/4; i++) {
+        for (i=0; i<blocksize/4; i++) {
             if (isread)
                 *(u32*)data = readl(&drive->regs->data);
             else
@@ -254,11 +321,37 @@ sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
         }
     }
     // Complete command
-    ret = sdcard_waitw(&drive->regs->irq_status, SI_TRANS_DONE);
-    if (ret < 0)
+    return sdcard_finish_transfer(drive, SDHCI_PIO_TIMEOUT);
+}
+
+// Transfer sectors using an ADMA2 descriptor table.
+static int
+sdcard_adma_transfer(struct sddrive_s *drive, int cmd, u32 arg
+                     , void *data, int count)
+{
+    u32 len = count * DISK_SECTOR_SIZE;
+    u32 addr = (u32)data;
+    struct sdhci_adma2_desc *desc = drive->adma;
+    for (;;) {
+        u32 dlen = len > SDHCI_ADMA_MAX_LEN ? SDHCI_ADMA_MAX_LEN : len;
+        desc->addr = addr;
+        desc->length = dlen; // 0 means 64KiB
+        desc->attr = SAD_VALID | SAD_TRAN;
+        addr += dlen;
+        len -= dlen;
+        if (!len)
+            break;
+        desc++;
+    }
+    desc->attr |= SAD_END;
+    writel(&drive->regs->adma_addr, (u32)drive->adma);
+    writel((void*)&drive->regs->adma_addr + 4, 0);
+
+    int ret = sdcard_start_transfer(drive, cmd, arg, count, DISK_SECTOR_SIZE
+                                    , ST_DMA);
+    if (ret)
         return ret;
-    writew(&drive->regs->irq_status, SI_TRANS_DONE);
-    return 0;
+    return sdcard_finish_transfer(drive, SDHCI_DMA_TIMEOUT);
 }
 
 // Read/write a block of data to/from the card.
@@ -267,12 +360,33 @@ sdcard_readwrite(struct disk_op_s *op, int iswrite)
 {
     struct sddrive_s *drive = container_of(
         op->drive_gf, struct sddrive_s, drive);
-    int cmd = iswrite ? SC_WRITE_SINGLE : SC_READ_SINGLE;
-    if (op->count > 1)
-        cmd = iswrite ? SC_WRITE_MULTIPLE : SC_READ_MULTIPLE;
-    int ret = sdcard_pio_transfer(drive, cmd, op->lba, op->buf_fl, op->count);
-    if (ret)
-        return DISK_RET_EBADTRACK;
+    // ADMA2 with 32-bit descriptors needs a dword aligned buffer
+    int usedma = drive->adma && !((u32)op->buf_fl & 3);
+    u32 lba = op->lba;
+    void *buf = op->buf_fl;
+    int remaining = op->count;
+    while (remaining) {
+        int count = remaining;
+        if (usedma && count > SDHCI_ADMA_MAX_SECTORS)
+            count = SDHCI_ADMA_MAX_SECTORS;
+        int cmd = iswrite ? SC_WRITE_SINGLE : SC_READ_SINGLE;
+        if (count > 1)
+            cmd = iswrite ? SC_WRITE_MULTIPLE : SC_READ_MULTIPLE;
+        u32 addr = lba;
+        if (!(drive->card_type & SF_HIGHCAPACITY))
+            addr *= DISK_SECTOR_SIZE;
+        int ret;
+        if (usedma)
+            ret = sdcard_adma_transfer(drive, cmd, addr, buf, count);
+        else
+            ret = sdcard_pio_transfer(drive, cmd, addr, buf, count
+                                      , DISK_SECTOR_SIZE);
+        if (ret)
+            return DISK_RET_EBADTRACK;
+        lba += count;
+        buf += count * DISK_SECTOR_SIZE;
+        remaining -= count;
+    }
     return DISK_RET_SUCCESS;
 }
 
@@ -368,10 +482,14 @@ sdcard_get_capacity(struct sddrive_s *drive, u8 *csd)
     if ((drive->card_type & SF_MMC) && CSD_STRUCTURE >= 2) {
         // Get capacity from EXT_CSD register
         u8 ext_csd[512];
-        int ret = sdcard_pio_transfer(drive, SC_SEND_EXT_CSD, 0, ext_csd, 1);
+        int ret = sdcard_pio_transfer(drive, SC_SEND_EXT_CSD, 0, ext_csd, 1
+                                      , sizeof(ext_csd));
         if (ret)
             return ret;
         count = *(u32*)&ext_csd[212];
+        // DEVICE_TYPE: high speed at 52MHz
+        if (ext_csd[196] & 0x02)
+            drive->card_type |= SF_HIGHSPEED;
     } else if (!(drive->card_type & SF_MMC) && CSD_STRUCTURE >= 1) {
         // High capacity SD card
         u32 C_SIZE2 = csd[5] | (csd[6] << 8) | ((csd[7] & 0x3f) << 16);
@@ -383,6 +501,69 @@ sdcard_get_capacity(struct sddrive_s *drive, u8 *csd)
     return 0;
 }
 
+// Ask an SD card to switch to high speed mode
+static int
+sdcard_sd_highspeed(struct sddrive_s *drive)
+{
+    // CMD6 in "switch" mode selecting function 1 (high speed) of group 1
+    u8 status[64];
+    int ret = sdcard_pio_transfer(drive, SC_SWITCH_FUNC, 0x80fffff1
+                                  , status, 1, sizeof(status));
+    if (ret)
+        return ret;
+    return (status[16] & 0x0f) == 0x01 ? 0 : -1;
+}
+
+// Send an MMC SWITCH command writing 'value' to EXT_CSD byte 'index'.
+static int
+sdcard_mmc_switch(struct sddrive_s *drive, u8 index, u8 value)
+{
+    u32 param[4] = { (0x03 << 24) | (index << 16) | (value << 8) };
+    int ret = sdcard_pio(drive->regs, SC_SWITCH, param);
+    if (ret)
+        return ret;
+    // Wait for the card to release the busy signal
+    return sdcard_finish_transfer(drive, SDHCI_PIO_TIMEOUT);
+}
+
+// Negotiate the bus width and clock rate used for data transfers
+static int
+sdcard_set_bus(struct sddrive_s *drive)
+{
+    struct sdhci_s *regs = drive->regs;
+    u8 hctl = readb(&regs->host_control);
+    int ret;
+
+    // Switch to a 4-bit data bus
+    if (drive->card_type & SF_MMC) {
+        ret = sdcard_mmc_switch(drive, 183, 1); // BUS_WIDTH
+    } else {
+        u32 param[4] = { 0x02 };
+        ret = sdcard_pio_app(regs, drive->rca, SC_APP_SET_BUS_WIDTH, param);
+    }
+    if (!ret)
+        hctl |= SHC_4BIT;
+
+    // Enable high speed timing if both the card and controller support it
+    u32 khz = 25000;
+    if (readl(&regs->cap_lo) & SD_CAPLO_HIGHSPEED) {
+        if (drive->card_type & SF_MMC) {
+            if (drive->card_type & SF_HIGHSPEED
+                && !sdcard_mmc_switch(drive, 185, 1)) // HS_TIMING
+                khz = 52000;
+        } else if (!sdcard_sd_highspeed(drive)) {
+            drive->card_type |= SF_HIGHSPEED;
+            khz = 50000;
+        }
+        if (khz > 25000)
+            hctl |= SHC_HIGHSPEED;
+    }
+    writeb(&regs->host_control, hctl);
+    dprintf(3, "sdcard@%p bus width %d, %dkHz\n"
+            , regs, hctl & SHC_4BIT ? 4 : 1, khz);
+    return sdcard_set_frequency(regs, khz);
+}
+
 // Initialize an SD card
 static int
 sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
@@ -406,7 +587,7 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         hcs = (1<<30);
     // Verify SD card (instead of MMC or SDIO)
     param[0] = 0x00;
-    ret = sdcard_pio_app(regs, SC_APP_SEND_OP_COND, param);
+    ret = sdcard_pio_app(regs, 0, SC_APP_SEND_OP_COND, param);
     if (ret) {
         // Check for MMC card
         param[0] = 0x00;
@@ -423,7 +604,7 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         if (drive->card_type & SF_MMC)
             ret = sdcard_pio(regs, SC_SEND_OP_COND, param);
         else
-            ret = sdcard_pio_app(regs, SC_APP_SEND_OP_COND, param);
+            ret = sdcard_pio_app(regs, 0, SC_APP_SEND_OP_COND, param);
         if (ret)
             return ret;
         if (param[0] & SR_OCR_NOTBUSY)
@@ -447,6 +628,7 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
     if (ret)
         return ret;
     u16 rca = drive->card_type & SF_MMC ? 0x0001 : param[0] >> 16;
+    drive->rca = rca;
     param[0] = rca << 16;
     ret = sdcard_pio(regs, SC_SEND_CSD, param);
     if (ret)
@@ -463,6 +645,9 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         return ret;
     // Register drive
     ret = sdcard_get_capacity(drive, csd);
+    if (ret)
+        return ret;
+    ret = sdcard_set_bus(drive);
     if (ret)
         return ret;
     char pnm[7] = {};
@@ -510,8 +695,18 @@ sdcard_controller_setup(struct sdhci_s *regs, int prio)
     memset(drive, 0, sizeof(*drive));
     drive->drive.type = DTYPE_SDCARD;
     drive->regs = regs;
+    u16 ver = readw(&regs->controller_version);
+    if ((ver & 0xff) >= 0x01 && readl(&regs->cap_lo) & SD_CAPLO_ADMA2) {
+        drive->adma = memalign_high(
+            sizeof(*drive->adma), sizeof(*drive->adma) * SDHCI_ADMA_DESCS);
+        if (drive->adma) {
+            u8 hctl = readb(&regs->host_control) & ~SHC_DMA_MASK;
+            writeb(&regs->host_control, hctl | SHC_ADMA2_32);
+        }
+    }
     int ret = sdcard_card_setup(drive, volt, prio);
     if (ret) {
+        free(drive->adma);
         free(drive);
         goto fail;
     }
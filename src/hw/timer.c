@@ -87,12 +87,14 @@ tsctimer_setup(void)
     dprintf(6, "tsc calibrate start=%u end=%u diff=%u\n"
             , (u32)start, (u32)end, (u32)diff);
     u64 t = DIV_ROUND_UP(diff * PMTIMER_HZ, CALIBRATE_COUNT);
+    bootprof_timer_prechange();
     while (t >= (1<<24)) {
         ShiftTSC++;
         t = (t + 1) >> 1;
     }
     TimerKHz = DIV_ROUND_UP((u32)t, 1000 * PMTIMER_TO_PIT);
     TimerPort = 0;
+    bootprof_timer_postchange();
 
     dprintf(1, "CPU Mhz=%u\n", (TimerKHz << ShiftTSC) / 1000);
 }
@@ -119,8 +121,10 @@ pmtimer_setup(u16 ioport)
     if (!CONFIG_PMTIMER)
         return;
     dprintf(1, "Using pmtimer, ioport 0x%x\n", ioport);
+    bootprof_timer_prechange();
     TimerPort = ioport;
     TimerKHz = DIV_ROUND_UP(PMTIMER_HZ, 1000);
+    bootprof_timer_postchange();
 }
 
 
@@ -143,7 +147,7 @@ timer_adjust_bits(u32 value, u32 validbits)
 }
 
 // Sample the current timer value.
-static u32
+u32
 timer_read(void)
 {
     u16 port = GET_GLOBAL(TimerPort);
@@ -175,15 +179,20 @@ timer_delay(u32 diff)
         cpu_relax();
 }
 
-static void
-timer_sleep(u32 diff)
+// Yield to other threads until the time 'end' (from timer_calc) passes.
+void
+timer_sleep_until(u32 end)
 {
-    u32 start = timer_read();
-    u32 end = start + diff;
     while (!timer_check(end))
         yield();
 }
 
+static void
+timer_sleep(u32 diff)
+{
+    timer_sleep_until(timer_read() + diff);
+}
+
 void ndelay(u32 count) {
     timer_delay(DIV_ROUND_UP(count * GET_GLOBAL(TimerKHz), 1000000));
 }
@@ -216,6 +225,16 @@ timer_calc_usec(u32 usecs)
     return timer_read() + DIV_ROUND_UP(GET_GLOBAL(TimerKHz) * usecs, 1000);
 }
 
+// Convert a difference of two timer_read() values to microseconds.
+u32
+timer_ticks_to_usec(u32 ticks)
+{
+    u32 khz = GET_GLOBAL(TimerKHz);
+    if (ticks < 0xffffffff / 1000)
+        return ticks * 1000 / khz;
+    return ticks / khz * 1000;
+}
+
 
 /****************************************************************
  * PIT setup
@@ -81,9 +81,17 @@ ehci_hub_reset(struct usbhub_s *hub, u32 port)
     // Finish reset on port
     portsc &= ~PORT_RESET;
     writel(portreg, portsc);
-    msleep(EHCI_TIME_POSTRESET);
-
-    portsc = readl(portreg);
+    u32 end = timer_calc(EHCI_TIME_POSTRESET);
+    for (;;) {
+        portsc = readl(portreg);
+        if (!(portsc & PORT_RESET))
+            break;
+        if (timer_check(end)) {
+            warn_timeout();
+            return -1;
+        }
+        yield();
+    }
     if (!(portsc & PORT_CONNECT))
         // No longer connected
         return -1;
@@ -126,11 +134,11 @@ check_ehci_ports(struct usb_ehci_s *cntl)
             writel(portreg, portsc);
         }
     }
-    msleep(EHCI_TIME_POSTPOWER);
 
     struct usbhub_s hub;
     memset(&hub, 0, sizeof(hub));
     hub.cntl = &cntl->usb;
+    hub.powerwait = EHCI_TIME_POSTPOWER;
     hub.portcount = cntl->checkports;
     hub.op = &ehci_HubOp;
     usb_enumerate(&hub);
@@ -208,6 +216,7 @@ ehci_free_pipes(struct usb_ehci_s *cntl)
             break;
         cntl->usb.freelist = usbpipe->freenext;
         struct ehci_pipe *pipe = container_of(usbpipe, struct ehci_pipe, pipe);
+        free(pipe->tds);
         free(pipe);
     }
 }
@@ -483,6 +492,14 @@ ehci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     memset(pipe, 0, sizeof(*pipe));
     ehci_desc2pipe(pipe, usbdev, epdesc);
     pipe->qh.qtd_next = pipe->qh.alt_next = EHCI_PTR_TERM;
+    if (eptype == USB_ENDPOINT_XFER_BULK) {
+        // Bulk pipes get a qtd chain of their own for large transfers.
+        struct ehci_qtd *tds = memalign_low(
+            EHCI_QTD_ALIGN, sizeof(*tds) * EHCI_BULK_QTDS);
+        if (tds)
+            memset(tds, 0, sizeof(*tds) * EHCI_BULK_QTDS);
+        pipe->tds = tds;
+    }
 
     // Add queue head to controller list.
     struct ehci_qh *async_qh = cntl->async_qh;
@@ -501,21 +518,28 @@ ehci_reset_pipe(struct ehci_pipe *pipe)
     SET_LOWFLAT(pipe->qh.token, GET_LOWFLAT(pipe->qh.token) & QTD_TOGGLE);
 }
 
+// Wait for 'td' to complete.  The td is on the stack unless 'lowtd'
+// is set, in which case it is in the low memory zone.
 static int
-ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, u32 end)
+ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, int lowtd, u32 end)
 {
     u32 status;
     for (;;) {
-        status = td->token;
+        status = lowtd ? GET_LOWFLAT(td->token) : td->token;
         if (!(status & QTD_STS_ACTIVE))
             break;
+        u32 qhtok = GET_LOWFLAT(pipe->qh.token);
+        if (qhtok & QTD_STS_HALT) {
+            // An earlier td in the chain failed.
+            status = qhtok;
+            break;
+        }
         if (timer_check(end)) {
             u32 cur = GET_LOWFLAT(pipe->qh.current);
-            u32 tok = GET_LOWFLAT(pipe->qh.token);
             u32 next = GET_LOWFLAT(pipe->qh.qtd_next);
             warn_timeout();
             dprintf(1, "ehci pipe=%p cur=%08x tok=%08x next=%x td=%p status=%x\n"
-                    , pipe, cur, tok, next, td, status);
+                    , pipe, cur, qhtok, next, td, status);
             ehci_reset_pipe(pipe);
             struct usb_ehci_s *cntl = container_of(
                 GET_LOWFLAT(pipe->pipe.cntl), struct usb_ehci_s, usb);
@@ -540,6 +564,54 @@ ehci_fill_tdbuf(struct ehci_qtd *td, u32 dest, int transfer)
         *pos++ = dest;
 }
 
+// Return the number of bytes a single qtd can transfer starting at 'dest'.
+static int
+ehci_td_len(u32 dest, u32 dataend, u16 maxpacket)
+{
+    int maxtransfer = 5*PAGE_SIZE - (dest & (PAGE_SIZE-1));
+    int transfer = dataend - dest;
+    if (transfer > maxtransfer)
+        transfer = ALIGN_DOWN(maxtransfer, maxpacket);
+    return transfer;
+}
+
+// Transfer bulk data using the pipe's own qtd chain.  As many qtds as
+// fit are queued at once and only the last one of each chain is waited on.
+static int
+ehci_send_bulk(struct ehci_pipe *pipe, struct ehci_qtd *tds, int dir
+               , void *data, int datasize)
+{
+    u16 maxpacket = GET_LOWFLAT(pipe->pipe.maxpacket);
+    u32 dest = (u32)data, dataend = dest + datasize;
+    u32 end = timer_calc(usb_xfer_time(&pipe->pipe, datasize));
+    while (dest < dataend) {
+        struct ehci_qtd *td = tds;
+        while (dest < dataend && td < &tds[EHCI_BULK_QTDS]) {
+            int transfer = ehci_td_len(dest, dataend, maxpacket);
+            SET_LOWFLAT(td->qtd_next, (u32)(td+1));
+            SET_LOWFLAT(td->alt_next, EHCI_PTR_TERM);
+            u32 pos = dest;
+            int i;
+            for (i=0; i<ARRAY_SIZE(td->buf); i++) {
+                SET_LOWFLAT(td->buf[i], pos < dest + transfer ? pos : 0);
+                pos = ALIGN_DOWN(pos + PAGE_SIZE, PAGE_SIZE);
+            }
+            SET_LOWFLAT(td->token, (ehci_explen(transfer) | QTD_STS_ACTIVE
+                                    | (dir ? QTD_PID_IN : QTD_PID_OUT)
+                                    | ehci_maxerr(3)));
+            td++;
+            dest += transfer;
+        }
+        SET_LOWFLAT((td-1)->qtd_next, EHCI_PTR_TERM);
+        barrier();
+        SET_LOWFLAT(pipe->qh.qtd_next, (u32)tds);
+        int ret = ehci_wait_td(pipe, td-1, 1, end);
+        if (ret)
+            return -1;
+    }
+    return 0;
+}
+
 #define STACKQTDS 6
 
 int
@@ -551,6 +623,9 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     struct ehci_pipe *pipe = container_of(p, struct ehci_pipe, pipe);
     dprintf(7, "ehci_send_pipe qh=%p dir=%d data=%p size=%d\n"
             , &pipe->qh, dir, data, datasize);
+    struct ehci_qtd *bulktds = GET_LOWFLAT(pipe->tds);
+    if (!cmd && bulktds && datasize)
+        return ehci_send_bulk(pipe, bulktds, dir, data, datasize);
 
     // Allocate tds on stack (with required alignment)
     u8 tdsbuf[sizeof(struct ehci_qtd) * STACKQTDS + EHCI_QTD_ALIGN - 1];
@@ -577,10 +652,7 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
             warn_noalloc();
             return -1;
         }
-        int maxtransfer = 5*PAGE_SIZE - (dest & (PAGE_SIZE-1));
-        int transfer = dataend - dest;
-        if (transfer > maxtransfer)
-            transfer = ALIGN_DOWN(maxtransfer, maxpacket);
+        int transfer = ehci_td_len(dest, dataend, maxpacket);
         td->qtd_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td+1);
         td->alt_next = EHCI_PTR_TERM;
         td->token = (ehci_explen(transfer) | toggle | QTD_STS_ACTIVE
@@ -609,7 +681,7 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     u32 end = timer_calc(usb_xfer_time(p, datasize));
     int i;
     for (i=0, td=tds; i<STACKQTDS; i++, td++) {
-        int ret = ehci_wait_td(pipe, td, end);
+        int ret = ehci_wait_td(pipe, td, 0, end);
         if (ret)
             return -1;
     }
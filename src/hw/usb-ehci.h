@@ -135,6 +135,7 @@ struct ehci_qh {
 
 
 #define EHCI_QTD_ALIGN 64 // Can't span a 4K boundary, so increase from 32
+#define EHCI_BULK_QTDS 8 // qtds queued at once on bulk pipes
 
 struct ehci_qtd {
     u32 qtd_next;
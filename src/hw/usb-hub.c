@@ -193,8 +193,8 @@ usb_hub_setup(struct usbdevice_s *usbdev)
         if (ret)
             return ret;
     }
-    // Wait for port power to stabilize.
-    msleep(desc.bPwrOn2PwrGood * 2);
+    // Port power stabilizes while usb_enumerate() looks for devices.
+    hub.powerwait = desc.bPwrOn2PwrGood * 2;
 
     usb_enumerate(&hub);
 
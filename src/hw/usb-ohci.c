@@ -104,12 +104,11 @@ check_ohci_ports(struct usb_ohci_s *cntl)
     rha &= ~(RH_A_PSM | RH_A_OCPM);
     writel(&cntl->regs->roothub_status, RH_HS_LPSC);
     writel(&cntl->regs->roothub_b, RH_B_PPCM);
-    msleep((rha >> 24) * 2);
-    // XXX - need to sleep for USB_TIME_SIGATT if just powered up?
 
     struct usbhub_s hub;
     memset(&hub, 0, sizeof(hub));
     hub.cntl = &cntl->usb;
+    hub.powerwait = (rha >> 24) * 2;
     hub.portcount = rha & RH_A_NDP;
     hub.op = &ohci_HubOp;
     usb_enumerate(&hub);
@@ -1,10 +1,8 @@
 // Code for handling usb attached scsi devices.
 //
-// only usb 2.0 for now.
-//
-// once we have xhci driver with usb 3.0 support this must
-// be updated to use usb3 streams so booting from usb3
-// devices actually works.
+// usb 2.0 devices are driven one command at a time using the
+// read/write ready IUs, usb 3.0 devices use xhci streams with the
+// command tag as stream id.
 //
 // Authors:
 //  Gerd Hoffmann <kraxel@redhat.com>
@@ -17,6 +15,7 @@
 #include "biosvar.h" // GET_GLOBALFLAT
 #include "block.h" // DTYPE_USB
 #include "blockcmd.h" // cdb_read
+#include "byteorder.h" // cpu_to_be16
 #include "config.h" // CONFIG_USB_UAS
 #include "malloc.h" // free
 #include "output.h" // dprintf
@@ -91,6 +90,113 @@ struct uasdrive_s {
     u32 lun;
 };
 
+#define UAS_MAX_TAGS  4
+#define UAS_MIN_SPLIT 64 // don't split requests into less than 64 blocks
+
+// Process a request on a usb3 device.  Large reads and writes are split
+// into several commands, each with its own tag (and stream), which are
+// all queued before waiting for any of them.
+static int
+uas_stream_op(struct disk_op_s *op, struct uasdrive_s *drive_gf)
+{
+    struct usb_pipe *status = GET_GLOBALFLAT(drive_gf->status);
+    struct usb_pipe *data_in = GET_GLOBALFLAT(drive_gf->data_in);
+    struct usb_pipe *data_out = GET_GLOBALFLAT(drive_gf->data_out);
+    int tags = GET_LOWFLAT(status->streams);
+    if (tags > GET_LOWFLAT(data_in->streams))
+        tags = GET_LOWFLAT(data_in->streams);
+    if (tags > GET_LOWFLAT(data_out->streams))
+        tags = GET_LOWFLAT(data_out->streams);
+    if (tags > UAS_MAX_TAGS)
+        tags = UAS_MAX_TAGS;
+
+    int cmds = 1;
+    if (op->command == CMD_READ || op->command == CMD_WRITE) {
+        cmds = op->count / UAS_MIN_SPLIT;
+        if (cmds > tags)
+            cmds = tags;
+        if (cmds < 1)
+            cmds = 1;
+    }
+    u32 per = DIV_ROUND_UP(op->count, cmds);
+
+    struct disk_op_s lops[UAS_MAX_TAGS];
+    uas_ui sts[UAS_MAX_TAGS];
+    uas_ui ui;
+    int i, blocksize = 0, ret;
+    for (i=0; i<cmds; i++) {
+        int tag = i + 1;
+        struct disk_op_s *lop = &lops[i];
+        *lop = *op;
+        if (cmds > 1) {
+            lop->lba = op->lba + i * per;
+            lop->count = i == cmds - 1 ? op->count - i * per : per;
+        }
+
+        memset(&ui, 0, sizeof(ui));
+        ui.hdr.id = UAS_UI_COMMAND;
+        ui.hdr.tag = cpu_to_be16(tag);
+        ui.command.lun[1] = GET_GLOBALFLAT(drive_gf->lun);
+        blocksize = scsi_fill_cmd(lop, ui.command.cdb, sizeof(ui.command.cdb));
+        if (blocksize < 0)
+            return default_process_op(op);
+        lop->buf_fl = op->buf_fl + i * per * blocksize;
+
+        // Queue status and data transfers before sending the command.
+        memset(&sts[i], 0xff, sizeof(sts[i]));
+        ret = usb_queue_stream(status, tag, USB_DIR_IN
+                               , MAKE_FLATPTR(GET_SEG(SS), &sts[i])
+                               , sizeof(sts[i]));
+        u32 bytes = lop->count * blocksize;
+        if (!ret && bytes) {
+            int isread = scsi_is_read(lop);
+            ret = usb_queue_stream(isread ? data_in : data_out, tag
+                                   , isread ? USB_DIR_IN : USB_DIR_OUT
+                                   , lop->buf_fl, bytes);
+        }
+        if (!ret)
+            ret = usb_send_bulk(GET_GLOBALFLAT(drive_gf->command), USB_DIR_OUT
+                                , MAKE_FLATPTR(GET_SEG(SS), &ui)
+                                , sizeof(ui.hdr) + sizeof(ui.command));
+        if (ret) {
+            dprintf(1, "uas: command send fail");
+            goto fail;
+        }
+    }
+
+    int failed = 0;
+    for (i=0; i<cmds; i++) {
+        int tag = i + 1;
+        struct disk_op_s *lop = &lops[i];
+        if (lop->count) {
+            int isread = scsi_is_read(lop);
+            ret = usb_wait_stream(isread ? data_in : data_out, tag);
+            if (ret) {
+                dprintf(1, "uas: data %s fail", isread ? "read" : "write");
+                goto fail;
+            }
+        }
+        ret = usb_wait_stream(status, tag);
+        if (ret) {
+            dprintf(1, "uas: status recv fail");
+            goto fail;
+        }
+        if (sts[i].hdr.id != UAS_UI_SENSE || sts[i].sense.status != 0)
+            failed = 1;
+    }
+    if (!failed)
+        return DISK_RET_SUCCESS;
+    return DISK_RET_EBADTRACK;
+
+fail:
+    // Other tags may still have status (on this stack) and data
+    // transfers queued - cancel them before returning.
+    usb_cancel_streams(status);
+    usb_cancel_streams(data_in);
+    usb_cancel_streams(data_out);
+    return DISK_RET_EBADTRACK;
+}
+
 int
 uas_process_op(struct disk_op_s *op)
 {
@@ -99,6 +205,8 @@ uas_process_op(struct disk_op_s *op)
 
     struct uasdrive_s *drive_gf = container_of(
         op->drive_gf, struct uasdrive_s, drive);
+    if (GET_LOWFLAT(GET_GLOBALFLAT(drive_gf->status)->streams))
+        return uas_stream_op(op, drive_gf);
 
     uas_ui ui;
     memset(&ui, 0, sizeof(ui));
@@ -233,6 +341,7 @@ usb_uas_setup(struct usbdevice_s *usbdev)
     struct usb_pipe *status = NULL;
     struct usb_pipe *data_in = NULL;
     struct usb_pipe *data_out = NULL;
+    int superspeed = 0;
     u8 *desc = (u8*)iface;
     while (desc) {
         desc += desc[0];
@@ -241,9 +350,9 @@ usb_uas_setup(struct usbdevice_s *usbdev)
             ep = (void*)desc;
             break;
         case USB_DT_ENDPOINT_COMPANION:
-            /* No support (yet) for usb3 streams */
-            dprintf(1, "Superspeed UAS devices not supported (yet)\n");
-            goto fail;
+            /* usb3 - the pipes must support streams */
+            superspeed = 1;
+            break;
         case 0x24:
             switch (desc[2]) {
             case UAS_PIPE_ID_COMMAND:
@@ -269,6 +378,11 @@ usb_uas_setup(struct usbdevice_s *usbdev)
     }
     if (!command || !status || !data_in || !data_out)
         goto fail;
+    if (superspeed && (!status->streams || !data_in->streams
+                       || !data_out->streams)) {
+        dprintf(1, "Superspeed UAS device without usb3 streams support\n");
+        goto fail;
+    }
 
     struct uasdrive_s lun0;
     uas_init_lun(&lun0, usbdev, command, status, data_in, data_out, 0);
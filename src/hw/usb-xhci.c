@@ -23,6 +23,10 @@
 
 #define XHCI_RING_ITEMS          16
 #define XHCI_RING_SIZE           (XHCI_RING_ITEMS*sizeof(struct xhci_trb))
+#define XHCI_TRB_MAX_LEN         (64*1024) // trb buffers can't cross 64KiB
+#define XHCI_TD_MAX_TRBS         4
+#define XHCI_MAX_STREAMS         4  // stream ids 1..4
+#define XHCI_STREAM_ARRAY_LOG    2  // MaxPStreams: 8 entry stream array
 
 /*
  *  xhci_ring structs are allocated with XHCI_RING_SIZE alignment,
@@ -223,6 +227,10 @@ struct xhci_ring {
     u32                  eidx;
     u32                  nidx;
     u32                  cs;
+    u32                  err;   // first failed transfer completion code
+    void                 *pend; // bulk data not yet queued
+    u32                  pendlen;
+    u32                  pflags;
     struct mutex_s       lock;
 };
 
@@ -234,6 +242,7 @@ struct usb_xhci_s {
     u32                  ports;
     u32                  slots;
     u8                   context64;
+    u8                   maxpsa;    // max primary stream array size (log2-1)
 
     /* xhci registers */
     struct xhci_caps     *caps;
@@ -257,6 +266,10 @@ struct xhci_pipe {
     u32                  epid;
     void                 *buf;
     int                  bufused;
+
+    /* usb3 streams (bulk endpoints only) */
+    struct xhci_streamctx *sctx;
+    struct xhci_ring     *srings[XHCI_MAX_STREAMS];
 };
 
 // --------------------------------------------------------------
@@ -390,12 +403,10 @@ static struct usbhub_op_s xhci_hub_ops = {
 static int
 xhci_check_ports(struct usb_xhci_s *xhci)
 {
-    // Wait for port power to stabilize.
-    msleep(XHCI_TIME_POSTPOWER);
-
     struct usbhub_s hub;
     memset(&hub, 0, sizeof(hub));
     hub.cntl = &xhci->usb;
+    hub.powerwait = XHCI_TIME_POSTPOWER;
     hub.portcount = xhci->ports;
     hub.op = &xhci_hub_ops;
     usb_enumerate(&hub);
@@ -534,6 +545,7 @@ xhci_controller_setup(struct pci_device *pci)
     xhci->slots = hcs1         & 0xff;
     xhci->xcap  = ((hcc >> 16) & 0xffff) << 2;
     xhci->context64 = (hcc & 0x04) ? 1 : 0;
+    xhci->maxpsa = (hcc >> 12) & 0x0f;
 
     xhci->usb.pci = pci;
     xhci->usb.type = USB_TYPE_XHCI;
@@ -639,6 +651,8 @@ static void xhci_process_events(struct usb_xhci_s *xhci)
                     __func__, ring, rtrb, evt, evt_type, eidx, evt_cc);
             memcpy(evt, etrb, sizeof(*etrb));
             ring->eidx = eidx;
+            if (evt_type == ER_TRANSFER && evt_cc != CC_SUCCESS && !ring->err)
+                ring->err = evt_cc;
             break;
         }
         case ER_PORT_STATUS_CHANGE:
@@ -682,6 +696,13 @@ static int xhci_ring_busy(struct xhci_ring *ring)
     return (eidx != nidx);
 }
 
+// Number of trbs on a ring the controller has not reported back yet
+static int xhci_ring_pending(struct xhci_ring *ring)
+{
+    u32 usable = XHCI_RING_ITEMS - 1; // last entry is the link trb
+    return ((ring->nidx % usable) + usable - (ring->eidx % usable)) % usable;
+}
+
 static int xhci_event_wait(struct usb_xhci_s *xhci,
                            struct xhci_ring *ring,
                            u32 timeout)
@@ -823,6 +844,47 @@ static int xhci_cmd_evaluate_context(struct usb_xhci_s *xhci, u32 slotid
     return xhci_cmd_submit(xhci, &cmd);
 }
 
+static int xhci_cmd_reset_endpoint(struct usb_xhci_s *xhci, u32 slotid
+                                   , u32 epid)
+{
+    struct xhci_trb cmd = {
+        .ptr_low  = 0,
+        .ptr_high = 0,
+        .status   = 0,
+        .control  = (slotid << 24) | (epid << 16) | (CR_RESET_ENDPOINT << 10)
+    };
+    dprintf(3, "%s: slotid %d, epid %d\n", __func__, slotid, epid);
+    return xhci_cmd_submit(xhci, &cmd);
+}
+
+static int xhci_cmd_stop_endpoint(struct usb_xhci_s *xhci, u32 slotid
+                                  , u32 epid)
+{
+    struct xhci_trb cmd = {
+        .ptr_low  = 0,
+        .ptr_high = 0,
+        .status   = 0,
+        .control  = (slotid << 24) | (epid << 16) | (CR_STOP_ENDPOINT << 10)
+    };
+    dprintf(3, "%s: slotid %d, epid %d\n", __func__, slotid, epid);
+    return xhci_cmd_submit(xhci, &cmd);
+}
+
+static int xhci_cmd_set_tr_dequeue(struct usb_xhci_s *xhci, u32 slotid
+                                   , u32 epid, u32 stream
+                                   , struct xhci_ring *ring)
+{
+    struct xhci_trb cmd = {
+        .ptr_low  = (u32)&ring->ring[ring->nidx] | (1 << 1) | ring->cs,
+        .ptr_high = 0,
+        .status   = stream << 16,
+        .control  = (slotid << 24) | (epid << 16) | (CR_SET_TR_DEQUEUE << 10)
+    };
+    dprintf(3, "%s: slotid %d, epid %d, stream %d\n", __func__,
+            slotid, epid, stream);
+    return xhci_cmd_submit(xhci, &cmd);
+}
+
 static struct xhci_inctx *
 xhci_alloc_inctx(struct usbdevice_s *usbdev, int maxepid)
 {
@@ -895,6 +957,70 @@ static int xhci_config_hub(struct usbhub_s *hub)
     return 0;
 }
 
+// Return log2 of the number of streams a superspeed bulk endpoint
+// supports (from the endpoint companion descriptor following it).
+static int
+xhci_ep_maxstreams(struct usbdevice_s *usbdev
+                   , struct usb_endpoint_descriptor *epdesc)
+{
+    u8 *comp = (void*)epdesc + epdesc->bLength;
+    if ((void*)comp + 4 > (void*)usbdev->iface + usbdev->imax
+        || comp[1] != USB_DT_ENDPOINT_COMPANION)
+        return 0;
+    return comp[3] & 0x1f; // bmAttributes - MaxStreams
+}
+
+static void
+xhci_free_streams(struct xhci_pipe *pipe)
+{
+    int i;
+    for (i=0; i<XHCI_MAX_STREAMS; i++)
+        free(pipe->srings[i]);
+    free(pipe->sctx);
+}
+
+// Allocate a stream context array and a transfer ring per stream.
+// Returns the MaxPStreams value for the endpoint context (0 on failure).
+static int
+xhci_alloc_streams(struct usb_xhci_s *xhci, struct xhci_pipe *pipe
+                   , int maxstreams)
+{
+    int psa = XHCI_STREAM_ARRAY_LOG;
+    if (psa > xhci->maxpsa)
+        psa = xhci->maxpsa;
+    int entries = 1 << (psa + 1);
+    int count = entries - 1; // stream id 0 is reserved
+    if (count > XHCI_MAX_STREAMS)
+        count = XHCI_MAX_STREAMS;
+    if (count > (1 << maxstreams))
+        count = 1 << maxstreams;
+
+    int size = sizeof(*pipe->sctx) * entries;
+    pipe->sctx = memalign_high(16, size);
+    if (!pipe->sctx)
+        goto fail;
+    memset(pipe->sctx, 0, size);
+    int i;
+    for (i=0; i<count; i++) {
+        struct xhci_ring *ring = memalign_high(XHCI_RING_SIZE, sizeof(*ring));
+        if (!ring)
+            goto fail;
+        memset(ring, 0, sizeof(*ring));
+        ring->cs = 1;
+        pipe->srings[i] = ring;
+        pipe->sctx[i+1].deq_low = (u32)&ring->ring[0] | (1 << 1) | 1; // sct, dcs
+    }
+    pipe->pipe.streams = count;
+    return psa;
+
+fail:
+    warn_noalloc();
+    xhci_free_streams(pipe);
+    memset(pipe->srings, 0, sizeof(pipe->srings));
+    pipe->sctx = NULL;
+    return 0;
+}
+
 static struct usb_pipe *
 xhci_alloc_pipe(struct usbdevice_s *usbdev
                 , struct usb_endpoint_descriptor *epdesc)
@@ -950,6 +1076,17 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
     ep->deq_low  = (u32)&pipe->reqs.ring[0];
     ep->deq_low  |= 1;         // dcs
     ep->length   = pipe->pipe.maxpacket;
+    int maxstreams = 0;
+    if (eptype == USB_ENDPOINT_XFER_BULK && xhci->maxpsa)
+        maxstreams = xhci_ep_maxstreams(usbdev, epdesc);
+    if (maxstreams) {
+        int psa = xhci_alloc_streams(xhci, pipe, maxstreams);
+        if (psa) {
+            ep->ctx[0] |= (psa << 10) | (1 << 15); // MaxPStreams, LSA
+            ep->deq_low = (u32)pipe->sctx;
+            dprintf(3, "%s: %d streams\n", __func__, pipe->pipe.streams);
+        }
+    }
 
     dprintf(3, "%s: usbdev %p, ring %p, slotid %d, epid %d\n", __func__,
             usbdev, &pipe->reqs, pipe->slotid, pipe->epid);
@@ -1007,6 +1144,7 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
     return &pipe->pipe;
 
 fail:
+    xhci_free_streams(pipe);
     free(pipe->buf);
     free(pipe);
     free(in);
@@ -1055,7 +1193,13 @@ xhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     return upipe;
 }
 
-static void xhci_xfer_queue(struct xhci_pipe *pipe,
+// Return the transfer ring of a stream (stream 0 is the endpoint ring)
+static struct xhci_ring *xhci_pipe_ring(struct xhci_pipe *pipe, int stream)
+{
+    return stream ? pipe->srings[stream - 1] : &pipe->reqs;
+}
+
+static void xhci_xfer_queue(struct xhci_ring *ring,
                             void *data, int datalen, u32 flags)
 {
     struct xhci_trb trb;
@@ -1066,26 +1210,112 @@ static void xhci_xfer_queue(struct xhci_pipe *pipe,
         trb.ptr_low  = (u32)data;
     trb.status = datalen;
     trb.control = flags;
-    xhci_trb_queue(&pipe->reqs, &trb);
+    xhci_trb_queue(ring, &trb);
 }
 
-static void xhci_xfer_kick(struct xhci_pipe *pipe)
+static void xhci_xfer_kick(struct xhci_pipe *pipe, int stream)
 {
     struct usb_xhci_s *xhci = container_of(
         pipe->pipe.cntl, struct usb_xhci_s, usb);
     u32 slotid = pipe->slotid;
     u32 epid = pipe->epid;
 
-    dprintf(5, "%s: ring %p, slotid %d, epid %d\n",
-            __func__, &pipe->reqs, slotid, epid);
-    xhci_doorbell(xhci, slotid, epid);
+    dprintf(5, "%s: ring %p, slotid %d, epid %d, stream %d\n",
+            __func__, xhci_pipe_ring(pipe, stream), slotid, epid, stream);
+    xhci_doorbell(xhci, slotid, epid | (stream << 16));
 }
 
 static void xhci_xfer_normal(struct xhci_pipe *pipe,
                              void *data, int datalen)
 {
-    xhci_xfer_queue(pipe, data, datalen, (TR_NORMAL << 10) | TRB_TR_IOC);
-    xhci_xfer_kick(pipe);
+    xhci_xfer_queue(&pipe->reqs, data, datalen
+                    , (TR_NORMAL << 10) | TRB_TR_IOC);
+    xhci_xfer_kick(pipe, 0);
+}
+
+// Queue one TD of up to XHCI_TD_MAX_TRBS chained normal trbs, split on
+// 64KiB boundaries.  Returns the number of bytes covered by the TD.
+static int xhci_xfer_td(struct xhci_ring *ring, u32 maxpacket
+                        , void *data, int datalen, u32 flags)
+{
+    int queued = 0, trbs = 0;
+    for (;;) {
+        u32 addr = (u32)data + queued;
+        int len = XHCI_TRB_MAX_LEN - (addr & (XHCI_TRB_MAX_LEN - 1));
+        if (len > datalen - queued)
+            len = datalen - queued;
+        queued += len;
+        trbs++;
+        int last = (queued == datalen || trbs == XHCI_TD_MAX_TRBS);
+        // TD size: packets left in this TD after this trb
+        u32 tdsize = 0;
+        if (!last) {
+            int left = datalen - queued;
+            int maxleft = (XHCI_TD_MAX_TRBS - trbs) * XHCI_TRB_MAX_LEN;
+            if (left > maxleft)
+                left = maxleft;
+            tdsize = DIV_ROUND_UP(left, maxpacket);
+            if (tdsize > 31)
+                tdsize = 31;
+        }
+        xhci_xfer_queue(ring, (void*)addr, len | (tdsize << 17)
+                        , (TR_NORMAL << 10) | flags
+                        | (last ? TRB_TR_IOC : TRB_TR_CH));
+        if (last)
+            return queued;
+    }
+}
+
+// Queue as many TDs of the ring's pending bulk data as there is room for.
+static void xhci_ring_fill(struct xhci_pipe *pipe, int stream)
+{
+    struct xhci_ring *ring = xhci_pipe_ring(pipe, stream);
+    int kick = 0;
+    while (ring->pendlen && (xhci_ring_pending(ring) + XHCI_TD_MAX_TRBS
+                             < XHCI_RING_ITEMS - 1)) {
+        int len = xhci_xfer_td(ring, pipe->pipe.maxpacket
+                               , ring->pend, ring->pendlen, ring->pflags);
+        ring->pend += len;
+        ring->pendlen -= len;
+        kick = 1;
+    }
+    if (kick)
+        xhci_xfer_kick(pipe, stream);
+}
+
+// Start a bulk transfer on a ring without waiting for it.
+static void xhci_xfer_bulk(struct xhci_pipe *pipe, int stream, int dir
+                           , void *data, int datalen)
+{
+    struct xhci_ring *ring = xhci_pipe_ring(pipe, stream);
+    ring->err = 0;
+    ring->pend = data;
+    ring->pendlen = datalen;
+    ring->pflags = dir ? TRB_TR_ISP : 0;
+    xhci_ring_fill(pipe, stream);
+}
+
+// Wait for all bulk data of a ring, queuing the rest as room frees up.
+static int xhci_ring_drain(struct xhci_pipe *pipe, int stream, u32 end)
+{
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    struct xhci_ring *ring = xhci_pipe_ring(pipe, stream);
+    for (;;) {
+        xhci_process_events(xhci);
+        if (ring->err) {
+            dprintf(1, "%s: xfer failed (cc %d)\n", __func__, ring->err);
+            return -1;
+        }
+        xhci_ring_fill(pipe, stream);
+        if (!ring->pendlen && !xhci_ring_busy(ring))
+            return 0;
+        if (timer_check(end)) {
+            warn_timeout();
+            return -1;
+        }
+        yield();
+    }
 }
 
 int
@@ -1104,15 +1334,18 @@ xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
             // Set address command sent during xhci_alloc_pipe.
             return 0;
 
-        xhci_xfer_queue(pipe, (void*)req, USB_CONTROL_SETUP_SIZE
+        xhci_xfer_queue(&pipe->reqs, (void*)req, USB_CONTROL_SETUP_SIZE
                         , (TR_SETUP << 10) | TRB_TR_IDT
                         | ((datalen ? (dir ? 3 : 2) : 0) << 16));
         if (datalen)
-            xhci_xfer_queue(pipe, data, datalen, (TR_DATA << 10)
+            xhci_xfer_queue(&pipe->reqs, data, datalen, (TR_DATA << 10)
                             | ((dir ? 1 : 0) << 16));
-        xhci_xfer_queue(pipe, NULL, 0, (TR_STATUS << 10) | TRB_TR_IOC
+        xhci_xfer_queue(&pipe->reqs, NULL, 0, (TR_STATUS << 10) | TRB_TR_IOC
                         | ((dir ? 0 : 1) << 16));
-        xhci_xfer_kick(pipe);
+        xhci_xfer_kick(pipe, 0);
+    } else if (datalen) {
+        xhci_xfer_bulk(pipe, 0, dir, data, datalen);
+        return xhci_ring_drain(pipe, 0, timer_calc(usb_xfer_time(p, datalen)));
     } else {
         xhci_xfer_normal(pipe, data, datalen);
     }
@@ -1126,6 +1359,66 @@ xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     return 0;
 }
 
+// Start a bulk transfer on a usb3 stream of an endpoint.
+int
+xhci_queue_stream(struct usb_pipe *p, int stream, int dir
+                  , void *data, int datalen)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    if (stream < 1 || stream > pipe->pipe.streams || !datalen)
+        return -1;
+    xhci_xfer_bulk(pipe, stream, dir, data, datalen);
+    return 0;
+}
+
+// Wait for the transfer started on a stream with xhci_queue_stream().
+int
+xhci_wait_stream(struct usb_pipe *p, int stream)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    if (stream < 1 || stream > pipe->pipe.streams)
+        return -1;
+    return xhci_ring_drain(pipe, stream, timer_calc(usb_xfer_time(p, 0)));
+}
+
+// Cancel all transfers queued on the streams of an endpoint.  The
+// endpoint is stopped (after clearing a halt) and the dequeue pointer
+// of each stream is moved past the abandoned trbs.
+int
+xhci_cancel_streams(struct usb_pipe *p)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    u32 slotid = pipe->slotid, epid = pipe->epid;
+
+    // Reset fails unless the endpoint is halted, stop fails if the
+    // endpoint is already stopped - neither is an error here.
+    xhci_cmd_reset_endpoint(xhci, slotid, epid);
+    xhci_cmd_stop_endpoint(xhci, slotid, epid);
+    xhci_process_events(xhci);
+
+    int i, ret = 0;
+    for (i=1; i<=pipe->pipe.streams; i++) {
+        struct xhci_ring *ring = xhci_pipe_ring(pipe, i);
+        ring->pendlen = 0;
+        ring->err = 0;
+        ring->eidx = ring->nidx;
+        int cc = xhci_cmd_set_tr_dequeue(xhci, slotid, epid, i, ring);
+        if (cc != CC_SUCCESS) {
+            dprintf(1, "%s: set dequeue failed (cc %d)\n", __func__, cc);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
 int VISIBLE32FLAT
 xhci_poll_intr(struct usb_pipe *p, void *data)
 {
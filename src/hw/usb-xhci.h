@@ -15,6 +15,10 @@ struct usb_pipe *xhci_realloc_pipe(struct usbdevice_s *usbdev
 int xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
 int xhci_poll_intr(struct usb_pipe *p, void *data);
+int xhci_queue_stream(struct usb_pipe *p, int stream, int dir
+                      , void *data, int datalen);
+int xhci_wait_stream(struct usb_pipe *p, int stream);
+int xhci_cancel_streams(struct usb_pipe *p);
 
 // --------------------------------------------------------------
 // register interface
@@ -101,6 +105,14 @@ struct xhci_epctx {
     u32 reserved_01[3];
 } PACKED;
 
+// stream context
+struct xhci_streamctx {
+    u32 deq_low;
+    u32 deq_high;
+    u32 edtla;
+    u32 reserved_01;
+} PACKED;
+
 // device context array element
 struct xhci_devlist {
     u32 ptr_low;
@@ -129,6 +129,35 @@ usb_send_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
     return usb_send_pipe(pipe_fl, dir, NULL, data, datasize);
 }
 
+// Start a bulk transfer on a usb3 stream of an endpoint; it runs in
+// the background until usb_wait_stream() is called.
+int
+usb_queue_stream(struct usb_pipe *pipe_fl, int stream, int dir
+                 , void *data, int datasize)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_queue_stream(pipe_fl, stream, dir, data, datasize);
+}
+
+// Wait for a transfer started with usb_queue_stream()
+int
+usb_wait_stream(struct usb_pipe *pipe_fl, int stream)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_wait_stream(pipe_fl, stream);
+}
+
+// Cancel all transfers started with usb_queue_stream() on a pipe
+int
+usb_cancel_streams(struct usb_pipe *pipe_fl)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_cancel_streams(pipe_fl);
+}
+
 // Check if a pipe for a given controller is on the freelist
 int
 usb_is_freelist(struct usb_s *cntl, struct usb_pipe *pipe)
@@ -298,9 +327,12 @@ usb_set_address(struct usbdevice_s *usbdev)
     if (cntl->maxaddr >= USB_MAXADDR)
         return -1;
 
-    msleep(USB_TIME_RSTRCY);
-
-    // Create a pipe for the default address.
+    // Create a pipe for the default address while the device recovers
+    // from the port reset - except on xhci, where allocating the pipe
+    // already sends the set address request to the device.
+    u32 end = timer_calc(USB_TIME_RSTRCY);
+    if (cntl->type == USB_TYPE_XHCI)
+        timer_sleep_until(end);
     struct usb_endpoint_descriptor epdesc = {
         .wMaxPacketSize = speed_to_ctlsize[usbdev->speed],
         .bmAttributes = USB_ENDPOINT_XFER_CONTROL,
@@ -308,6 +340,7 @@ usb_set_address(struct usbdevice_s *usbdev)
     usbdev->defpipe = usb_alloc_pipe(usbdev, &epdesc);
     if (!usbdev->defpipe)
         return -1;
+    timer_sleep_until(end);
 
     // Send set_address command.
     struct usb_ctrlrequest req;
@@ -322,8 +355,6 @@ usb_set_address(struct usbdevice_s *usbdev)
         return -1;
     }
 
-    msleep(USB_TIME_SETADDR_RECOVERY);
-
     cntl->maxaddr++;
     usbdev->devaddr = cntl->maxaddr;
     usbdev->defpipe = usb_realloc_pipe(usbdev, usbdev->defpipe, &epdesc);
@@ -424,6 +455,9 @@ usb_hub_port_setup(void *data)
 
     // XXX - wait USB_TIME_ATTDB time?
 
+    // A port must not be reset until its power is good.
+    timer_sleep_until(hub->powerend);
+
     // Reset port and determine device speed
     mutex_lock(&hub->cntl->resetlock);
     int ret = hub->op->reset(hub, port);
@@ -440,6 +474,10 @@ usb_hub_port_setup(void *data)
     }
     mutex_unlock(&hub->cntl->resetlock);
 
+    // The device no longer answers on the default address, so other
+    // ports may be reset while this one finishes its address recovery.
+    timer_sleep_until(timer_calc(USB_TIME_SETADDR_RECOVERY));
+
     // Configure the device
     int count = configure_usb_device(usbdev);
     usb_free_pipe(usbdev, usbdev->defpipe);
@@ -463,7 +501,10 @@ usb_enumerate(struct usbhub_s *hub)
 {
     u32 portcount = hub->portcount;
     hub->threads = portcount;
-    hub->detectend = timer_calc(usb_time_sigatt);
+    // Ports are polled for a connection while their power stabilizes
+    // - a device can not signal attach until it has power.
+    hub->powerend = timer_calc(hub->powerwait);
+    hub->detectend = timer_calc(hub->powerwait + usb_time_sigatt);
 
     // Launch a thread for every port.
     int i;
@@ -16,6 +16,7 @@ struct usb_pipe {
     u8 speed;
     u16 maxpacket;
     u8 eptype;
+    u8 streams;     // usb3 stream ids available (1..streams), 0 if none
 };
 
 // Common information for usb devices.
@@ -45,6 +46,8 @@ struct usbhub_s {
     struct usbdevice_s *usbdev;
     struct usb_s *cntl;
     struct mutex_s lock;
+    u32 powerwait;
+    u32 powerend;
     u32 detectend;
     u32 port;
     u32 threads;
@@ -230,6 +233,10 @@ struct usb_endpoint_descriptor {
 
 // usb.c
 int usb_send_bulk(struct usb_pipe *pipe, int dir, void *data, int datasize);
+int usb_queue_stream(struct usb_pipe *pipe_fl, int stream, int dir
+                     , void *data, int datasize);
+int usb_wait_stream(struct usb_pipe *pipe_fl, int stream);
+int usb_cancel_streams(struct usb_pipe *pipe_fl);
 int usb_poll_intr(struct usb_pipe *pipe, void *data);
 int usb_32bit_pipe(struct usb_pipe *pipe_fl);
 struct usb_pipe *usb_alloc_pipe(struct usbdevice_s *usbdev
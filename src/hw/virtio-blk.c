@@ -23,59 +23,155 @@
 #include "virtio-ring.h"
 #include "virtio-blk.h"
 
+// Maximum number of requests queued before kicking the host.
+#define VIRTIO_BLK_MAX_REQS 8
+// Maximum number of data descriptors used by a single request.
+#define VIRTIO_BLK_MAX_SEGS 16
+
 struct virtiodrive_s {
     struct drive_s drive;
     struct vring_virtqueue *vq;
     struct vp_device vp;
+    u32 size_max;               // max bytes per data descriptor (0 = any)
+    u16 seg_max;                // max data descriptors per request
+    u16 max_sectors;            // max sectors per request
+    struct vring_desc *indirect;
+};
+
+struct virtio_blk_req {
+    struct virtio_blk_outhdr hdr;
+    u8 status;
 };
 
+// Add a request for count sectors at buf to the ring.  Returns the
+// number of ring descriptors used, or 0 if the ring is too full.
+static int
+virtio_blk_add_req(struct virtiodrive_s *vdrive, struct virtio_blk_req *req,
+                   int idx, int room, char *buf, u16 count, int write)
+{
+    struct vring_list sg[VIRTIO_BLK_MAX_SEGS + 2];
+    u32 bytes = vdrive->drive.blksize * count;
+    int segs = 0;
+
+    sg[segs].addr = (void*)&req->hdr;
+    sg[segs++].length = sizeof(req->hdr);
+    while (bytes) {
+        u32 len = bytes;
+        if (vdrive->size_max && len > vdrive->size_max)
+            len = vdrive->size_max;
+        sg[segs].addr = buf;
+        sg[segs++].length = len;
+        buf += len;
+        bytes -= len;
+    }
+    sg[segs].addr = (void*)&req->status;
+    sg[segs++].length = sizeof(req->status);
+
+    int out = write ? segs - 1 : 1;
+    if (vdrive->indirect) {
+        if (!room)
+            return 0;
+        struct vring_desc *table =
+            &vdrive->indirect[idx * (VIRTIO_BLK_MAX_SEGS + 2)];
+        vring_add_indirect(vdrive->vq, table, sg, out, segs - out, idx, idx);
+        return 1;
+    }
+    if (segs > room)
+        return 0;
+    vring_add_buf(vdrive->vq, sg, out, segs - out, idx, idx);
+    return segs;
+}
+
 static int
 virtio_blk_op(struct disk_op_s *op, int write)
 {
     struct virtiodrive_s *vdrive_gf =
         container_of(op->drive_gf, struct virtiodrive_s, drive);
     struct vring_virtqueue *vq = vdrive_gf->vq;
-    struct virtio_blk_outhdr hdr = {
-        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-        .ioprio = 0,
-        .sector = op->lba,
-    };
-    u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr       = (void*)(&hdr),
-            .length     = sizeof(hdr),
-        },
-        {
-            .addr       = op->buf_fl,
-            .length     = vdrive_gf->drive.blksize * op->count,
-        },
-        {
-            .addr       = (void*)(&status),
-            .length     = sizeof(status),
-        },
-    };
-
-    /* Add to virtqueue and kick host */
-    if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
-    else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
-    vring_kick(&vdrive_gf->vp, vq, 1);
-
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
-
-    /* Reclaim virtqueue element */
-    vring_get_buf(vq, NULL);
-
-    /* Clear interrupt status register.  Avoid leaving interrupts stuck if
-     * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
-     */
-    vp_get_isr(&vdrive_gf->vp);
-
-    return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    struct virtio_blk_req reqs[VIRTIO_BLK_MAX_REQS];
+    char *buf = op->buf_fl;
+    u64 lba = op->lba;
+    u16 remaining = op->count;
+    int ret = DISK_RET_SUCCESS;
+
+    while (remaining && ret == DISK_RET_SUCCESS) {
+        /* Queue as many requests as fit on the ring and kick host once */
+        int room = vq->vring.num, num_added = 0;
+        while (remaining && num_added < ARRAY_SIZE(reqs)) {
+            struct virtio_blk_req *req = &reqs[num_added];
+            u16 count = remaining;
+            if (count > vdrive_gf->max_sectors)
+                count = vdrive_gf->max_sectors;
+            req->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            req->hdr.ioprio = 0;
+            req->hdr.sector = lba;
+            req->status = VIRTIO_BLK_S_UNSUPP;
+
+            int used = virtio_blk_add_req(vdrive_gf, req, num_added, room
+                                          , buf, count, write);
+            if (!used)
+                break;
+            room -= used;
+            num_added++;
+            buf += vdrive_gf->drive.blksize * count;
+            lba += count;
+            remaining -= count;
+        }
+        if (!num_added)
+            return DISK_RET_EBADTRACK;
+        vring_kick(&vdrive_gf->vp, vq, num_added);
+
+        /* Wait for all replies and reclaim virtqueue elements */
+        int i;
+        for (i = 0; i < num_added; i++) {
+            while (!vring_more_used(vq))
+                usleep(5);
+            vring_get_buf(vq, NULL);
+        }
+
+        /* Clear interrupt status register.  Avoid leaving interrupts stuck if
+         * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
+         */
+        vp_get_isr(&vdrive_gf->vp);
+
+        for (i = 0; i < num_added; i++)
+            if (reqs[i].status != VIRTIO_BLK_S_OK)
+                ret = DISK_RET_EBADTRACK;
+    }
+
+    return ret;
+}
+
+// Apply the negotiated segment limits and set up indirect descriptors.
+static void
+virtio_blk_init_limits(struct virtiodrive_s *vdrive, u64 features,
+                       u32 size_max, u32 seg_max)
+{
+    vdrive->size_max = 0;
+    vdrive->seg_max = VIRTIO_BLK_MAX_SEGS;
+    if (features & (1ull << VIRTIO_BLK_F_SIZE_MAX) && size_max)
+        vdrive->size_max = ALIGN_DOWN(size_max, DISK_SECTOR_SIZE) ?: size_max;
+    if (features & (1ull << VIRTIO_BLK_F_SEG_MAX) && seg_max
+        && seg_max < VIRTIO_BLK_MAX_SEGS)
+        vdrive->seg_max = seg_max;
+    if (vdrive->seg_max + 2 > vdrive->vq->vring.num)
+        vdrive->seg_max = vdrive->vq->vring.num > 2 ? vdrive->vq->vring.num - 2 : 1;
+
+    u32 max_bytes = vdrive->size_max * vdrive->seg_max;
+    vdrive->max_sectors = 0xffff;
+    if (vdrive->size_max && max_bytes / DISK_SECTOR_SIZE < 0xffff)
+        vdrive->max_sectors = max_bytes / DISK_SECTOR_SIZE ?: 1;
+
+    if (features & (1ull << VIRTIO_RING_F_INDIRECT_DESC)) {
+        u32 size = (sizeof(*vdrive->indirect) * VIRTIO_BLK_MAX_REQS
+                    * (VIRTIO_BLK_MAX_SEGS + 2));
+        vdrive->indirect = malloc_high(size);
+        if (!vdrive->indirect)
+            warn_noalloc();
+    }
+    dprintf(3, "virtio-blk size_max=%u seg_max=%u max_sectors=%u indirect=%d\n"
+            , vdrive->size_max, vdrive->seg_max, vdrive->max_sectors
+            , !!vdrive->indirect);
 }
 
 int
@@ -109,22 +205,26 @@ init_virtio_blk(void *data)
     vdrive->drive.cntl_id = pci->bdf;
 
     vp_init_simple(&vdrive->vp, pci);
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
-        dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
-        goto fail;
-    }
 
+    /* The ring layout depends on the negotiated features, so the queue
+     * is only set up once feature negotiation is done. */
+    u64 features;
+    u32 size_max, seg_max;
     if (vdrive->vp.use_modern) {
         struct vp_device *vp = &vdrive->vp;
-        u64 features = vp_get_features(vp);
+        features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
+        u64 segs = ((1ull << VIRTIO_BLK_F_SIZE_MAX)
+                    | (1ull << VIRTIO_BLK_F_SEG_MAX)
+                    | (1ull << VIRTIO_RING_F_INDIRECT_DESC));
+        u64 packed = CONFIG_VIRTIO_RING_PACKED ? 1ull << VIRTIO_F_RING_PACKED : 0;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        features = features & (version1 | blk_size);
+        features = features & (version1 | blk_size | segs | packed);
         vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
@@ -155,12 +255,19 @@ init_virtio_blk(void *data)
             vp_read(&vp->device, struct virtio_blk_config, heads);
         vdrive->drive.pchs.sector =
             vp_read(&vp->device, struct virtio_blk_config, sectors);
+
+        size_max = vp_read(&vp->device, struct virtio_blk_config, size_max);
+        seg_max = vp_read(&vp->device, struct virtio_blk_config, seg_max);
     } else {
         struct virtio_blk_config cfg;
         vp_get_legacy(&vdrive->vp, 0, &cfg, sizeof(cfg));
 
-        u64 f = vp_get_features(&vdrive->vp);
-        vdrive->drive.blksize = (f & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
+        features = vp_get_features(&vdrive->vp);
+        features &= ((1 << VIRTIO_BLK_F_BLK_SIZE) | (1 << VIRTIO_BLK_F_SIZE_MAX)
+                     | (1 << VIRTIO_BLK_F_SEG_MAX)
+                     | (1 << VIRTIO_RING_F_INDIRECT_DESC));
+        vp_set_features(&vdrive->vp, features);
+        vdrive->drive.blksize = (features & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
             cfg.blk_size : DISK_SECTOR_SIZE;
 
         vdrive->drive.sectors = cfg.capacity;
@@ -175,7 +282,15 @@ init_virtio_blk(void *data)
         vdrive->drive.pchs.cylinder = cfg.cylinders;
         vdrive->drive.pchs.head = cfg.heads;
         vdrive->drive.pchs.sector = cfg.sectors;
+        size_max = cfg.size_max;
+        seg_max = cfg.seg_max;
+    }
+
+    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
+        dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
+        goto fail;
     }
+    virtio_blk_init_limits(vdrive, features, size_max, seg_max);
 
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk PCI:%pP", pci);
     boot_add_hd(&vdrive->drive, desc, bootprio_find_pci_device(pci));
@@ -187,6 +302,7 @@ init_virtio_blk(void *data)
 fail:
     vp_reset(&vdrive->vp);
     free(vdrive->vq);
+    free(vdrive->indirect);
     free(vdrive);
 }
 
@@ -16,6 +16,8 @@ struct virtio_blk_config
     u32 opt_io_size;
 } __attribute__((packed));
 
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX 2
 #define VIRTIO_BLK_F_BLK_SIZE 6
 
 /* These two define direction. */
@@ -17,6 +17,7 @@
  */
 
 #include "biosvar.h" // GET_GLOBAL
+#include "config.h" // CONFIG_VIRTIO_RING_PACKED
 #include "output.h" // panic
 #include "virtio-ring.h"
 #include "virtio-pci.h"
@@ -26,6 +27,107 @@
         } while (0)
 #define BUG_ON(condition) do { if (condition) BUG(); } while (0)
 
+/*
+ * vring_init_packed
+ *
+ * lay out a packed ring of num descriptors in vq->queue
+ *
+ */
+
+void vring_init_packed(struct vring_virtqueue *vq, unsigned int num)
+{
+    struct vring_packed *vr = &vq->packed;
+
+    ASSERT32FLAT();
+    vq->vring.num = num;
+
+    /* physical address of desc must be page aligned */
+    vr->desc = (void*)ALIGN((u32)vq->queue, PAGE_SIZE);
+    vr->driver = (void*)&vr->desc[num];
+    vr->device = &vr->driver[1];
+
+    /* disable interrupts */
+    vr->driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+    vq->is_packed = 1;
+    vq->free_head = 0;
+    vq->last_used_idx = 0;
+    vq->avail_wrap_counter = 1;
+    vq->used_wrap_counter = 1;
+}
+
+static int vring_packed_more_used(struct vring_virtqueue *vq)
+{
+    u16 flags = vq->packed.desc[vq->last_used_idx].flags;
+    int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+    int used = !!(flags & VRING_PACKED_DESC_F_USED);
+    /* Make sure descriptor reads are done after flags read above. */
+    smp_rmb();
+    return avail == used && used == vq->used_wrap_counter;
+}
+
+static int vring_packed_get_buf(struct vring_virtqueue *vq, unsigned int *len)
+{
+    struct vring_packed_desc *desc = &vq->packed.desc[vq->last_used_idx];
+    u16 id = desc->id;
+
+    if (len != NULL)
+        *len = desc->len;
+
+    /* the device writes a single used descriptor for the whole chain */
+    vq->last_used_idx += vq->chain_len[id];
+    if (vq->last_used_idx >= vq->vring.num) {
+        vq->last_used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
+
+    return vq->vdata[id];
+}
+
+static void vring_packed_add(struct vring_virtqueue *vq,
+                             struct vring_list list[],
+                             unsigned int out, unsigned int in,
+                             int index, u16 extra_flags)
+{
+    struct vring_packed_desc *desc = vq->packed.desc;
+    unsigned int i, num = out + in;
+    u16 head = vq->free_head, idx = head, head_flags = 0;
+    u8 wrap = vq->avail_wrap_counter;
+
+    BUG_ON(num == 0);
+
+    for (i = 0; i < num; i++) {
+        u16 flags = extra_flags;
+        if (i >= out)
+            flags |= VRING_DESC_F_WRITE;
+        if (i + 1 < num)
+            flags |= VRING_DESC_F_NEXT;
+        flags |= wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+
+        desc[idx].addr = (u64)virt_to_phys(list[i].addr);
+        desc[idx].len = list[i].length;
+        desc[idx].id = head;
+        if (i)
+            desc[idx].flags = flags;
+        else
+            head_flags = flags;
+
+        if (++idx >= vq->vring.num) {
+            idx = 0;
+            wrap ^= 1;
+        }
+    }
+
+    vq->free_head = idx;
+    vq->avail_wrap_counter = wrap;
+    vq->chain_len[head] = num;
+    vq->vdata[head] = index;
+
+    /* The device may see the chain as soon as the head flags are set. */
+    smp_wmb();
+    desc[head].flags = head_flags;
+}
+
 /*
  * vring_more_used
  *
@@ -35,6 +137,9 @@
 
 int vring_more_used(struct vring_virtqueue *vq)
 {
+    if (CONFIG_VIRTIO_RING_PACKED && vq->is_packed)
+        return vring_packed_more_used(vq);
+
     struct vring_used *used = vq->vring.used;
     int more = vq->last_used_idx != used->idx;
     /* Make sure ring reads are done after idx read above. */
@@ -81,6 +186,9 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
     u32 id;
     int ret;
 
+    if (CONFIG_VIRTIO_RING_PACKED && vq->is_packed)
+        return vring_packed_get_buf(vq, len);
+
 //    BUG_ON(!vring_more_used(vq));
 
     elem = &used->ring[vq->last_used_idx % vr->num];
@@ -107,6 +215,11 @@ void vring_add_buf(struct vring_virtqueue *vq,
     struct vring_desc *desc = vr->desc;
     struct vring_avail *avail = vr->avail;
 
+    if (CONFIG_VIRTIO_RING_PACKED && vq->is_packed) {
+        vring_packed_add(vq, list, out, in, index, 0);
+        return;
+    }
+
     BUG_ON(out + in == 0);
 
     prev = 0;
@@ -135,6 +248,63 @@ void vring_add_buf(struct vring_virtqueue *vq,
     avail->ring[av] = head;
 }
 
+/*
+ * vring_add_indirect
+ *
+ * like vring_add_buf, but describe the buffers in the caller provided
+ * indirect table, so the request only occupies a single ring descriptor
+ *
+ */
+
+void vring_add_indirect(struct vring_virtqueue *vq, struct vring_desc *table,
+                        struct vring_list list[],
+                        unsigned int out, unsigned int in,
+                        int index, int num_added)
+{
+    struct vring *vr = &vq->vring;
+    unsigned int i, num = out + in;
+    int av, head;
+    struct vring_desc *desc = vr->desc;
+    struct vring_avail *avail = vr->avail;
+
+    BUG_ON(num == 0);
+
+    if (CONFIG_VIRTIO_RING_PACKED && vq->is_packed) {
+        /* packed rings use the packed descriptor format in the table too */
+        struct vring_packed_desc *ptable = (void*)table;
+        for (i = 0; i < num; i++) {
+            ptable[i].addr = (u64)virt_to_phys(list[i].addr);
+            ptable[i].len = list[i].length;
+            ptable[i].id = i;
+            ptable[i].flags = i < out ? 0 : VRING_DESC_F_WRITE;
+        }
+        struct vring_list entry = {
+            .addr = (void*)table, .length = num * sizeof(*ptable) };
+        vring_packed_add(vq, &entry, 1, 0, index, VRING_DESC_F_INDIRECT);
+        return;
+    }
+
+    for (i = 0; i < num; i++) {
+        table[i].flags = i < out ? 0 : VRING_DESC_F_WRITE;
+        if (i + 1 < num)
+            table[i].flags |= VRING_DESC_F_NEXT;
+        table[i].addr = (u64)virt_to_phys(list[i].addr);
+        table[i].len = list[i].length;
+        table[i].next = i + 1;
+    }
+
+    head = vq->free_head;
+    desc[head].flags = VRING_DESC_F_INDIRECT;
+    desc[head].addr = (u64)virt_to_phys(table);
+    desc[head].len = num * sizeof(*table);
+    vq->free_head = desc[head].next;
+
+    vq->vdata[head] = index;
+
+    av = (avail->idx + num_added) % vr->num;
+    avail->ring[av] = head;
+}
+
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 {
     struct vring *vr = &vq->vring;
@@ -142,7 +312,8 @@ void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 
     /* Make sure idx update is done after ring write. */
     smp_wmb();
-    avail->idx = avail->idx + num_added;
+    if (!CONFIG_VIRTIO_RING_PACKED || !vq->is_packed)
+        avail->idx = avail->idx + num_added;
 
     vp_notify(vp, vq);
 }
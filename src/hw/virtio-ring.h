@@ -16,18 +16,28 @@
 /* We've given up on this device. */
 #define VIRTIO_CONFIG_S_FAILED          0x80
 
+/* Can use indirect descriptor tables. */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1              32
+/* Support for packed virtqueues (v1.1). */
+#define VIRTIO_F_RING_PACKED            34
 
 #define MAX_QUEUE_NUM      (128)
 
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
 #define VRING_USED_F_NO_NOTIFY     1
 
+#define VRING_PACKED_DESC_F_AVAIL  (1 << 7)
+#define VRING_PACKED_DESC_F_USED   (1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+
 struct vring_desc
 {
    u64 addr;
@@ -63,6 +73,26 @@ struct vring {
    struct vring_used *used;
 };
 
+struct vring_packed_desc
+{
+   u64 addr;
+   u32 len;
+   u16 id;
+   u16 flags;
+};
+
+struct vring_packed_desc_event
+{
+   u16 off_wrap;
+   u16 flags;
+};
+
+struct vring_packed {
+   struct vring_packed_desc *desc;
+   struct vring_packed_desc_event *driver;
+   struct vring_packed_desc_event *device;
+};
+
 #define vring_size(num) \
     (ALIGN(sizeof(struct vring_desc) * num + sizeof(struct vring_avail) \
            + sizeof(u16) * num, PAGE_SIZE)                              \
@@ -76,6 +106,12 @@ struct vring_virtqueue {
    u16 free_head;
    u16 last_used_idx;
    u16 vdata[MAX_QUEUE_NUM];
+   /* packed ring (free_head is the next slot to make available) */
+   struct vring_packed packed;
+   u8 is_packed;
+   u8 avail_wrap_counter;
+   u8 used_wrap_counter;
+   u8 chain_len[MAX_QUEUE_NUM];
    /* PCI */
    int queue_index;
    int queue_notify_off;
@@ -109,12 +145,17 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
 }
 
 struct vp_device;
+void vring_init_packed(struct vring_virtqueue *vq, unsigned int num);
 int vring_more_used(struct vring_virtqueue *vq);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len);
 void vring_add_buf(struct vring_virtqueue *vq, struct vring_list list[],
                    unsigned int out, unsigned int in,
                    int index, int num_added);
+void vring_add_indirect(struct vring_virtqueue *vq, struct vring_desc *table,
+                        struct vring_list list[],
+                        unsigned int out, unsigned int in,
+                        int index, int num_added);
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added);
 
 #endif /* _VIRTIO_RING_H_ */
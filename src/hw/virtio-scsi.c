@@ -24,47 +24,63 @@
 #include "virtio-ring.h"
 #include "virtio-scsi.h"
 
+/* Request queues and in-flight commands used at once for one disk_op_s */
+#define VIRTIO_SCSI_MAX_QUEUES 4
+#define VIRTIO_SCSI_MAX_REQS   8
+/* Smallest per-command sector count worth splitting a request into */
+#define VIRTIO_SCSI_MIN_SPLIT  64
+
+struct virtio_scsi_cmd {
+    struct virtio_scsi_req_cmd req;
+    struct virtio_scsi_resp_cmd resp;
+};
+
+struct virtio_scsi_ctrl {
+    struct vp_device vp;
+    struct vring_virtqueue *vqs[VIRTIO_SCSI_MAX_QUEUES];
+    int vq_count;
+    u32 max_sectors;
+    struct virtio_scsi_cmd cmds[VIRTIO_SCSI_MAX_REQS];
+};
+
 struct virtio_lun_s {
     struct drive_s drive;
     struct pci_device *pci;
-    struct vring_virtqueue *vq;
-    struct vp_device *vp;
+    struct virtio_scsi_ctrl *ctrl;
     u16 target;
     u16 lun;
 };
 
-int
-virtio_scsi_process_op(struct disk_op_s *op)
+// Build the command for 'op' and place it on 'vq'.  Returns the number of
+// descriptors used or 0 if the command could not be built.
+static int
+virtio_scsi_add_cmd(struct virtio_lun_s *vlun, struct vring_virtqueue *vq
+                    , struct virtio_scsi_cmd *cmd, struct disk_op_s *op
+                    , int num_added)
 {
-    if (! CONFIG_VIRTIO_SCSI)
-        return 0;
-    struct virtio_lun_s *vlun =
-        container_of(op->drive_gf, struct virtio_lun_s, drive);
-    struct vp_device *vp = vlun->vp;
-    struct vring_virtqueue *vq = vlun->vq;
-    struct virtio_scsi_req_cmd req;
-    struct virtio_scsi_resp_cmd resp;
     struct vring_list sg[3];
 
-    memset(&req, 0, sizeof(req));
-    int blocksize = scsi_fill_cmd(op, req.cdb, 16);
+    memset(&cmd->req, 0, sizeof(cmd->req));
+    memset(&cmd->resp, 0, sizeof(cmd->resp));
+    int blocksize = scsi_fill_cmd(op, cmd->req.cdb, 16);
     if (blocksize < 0)
-        return default_process_op(op);
-    req.lun[0] = 1;
-    req.lun[1] = vlun->target;
-    req.lun[2] = (vlun->lun >> 8) | 0x40;
-    req.lun[3] = (vlun->lun & 0xff);
+        return 0;
+    cmd->req.lun[0] = 1;
+    cmd->req.lun[1] = vlun->target;
+    cmd->req.lun[2] = (vlun->lun >> 8) | 0x40;
+    cmd->req.lun[3] = (vlun->lun & 0xff);
+    cmd->req.id = num_added;
 
     u32 len = op->count * blocksize;
     int datain = scsi_is_read(op);
     int in_num = (datain ? 2 : 1);
     int out_num = (len ? 3 : 2) - in_num;
 
-    sg[0].addr   = (void*)(&req);
-    sg[0].length = sizeof(req);
+    sg[0].addr   = (void*)(&cmd->req);
+    sg[0].length = sizeof(cmd->req);
 
-    sg[out_num].addr   = (void*)(&resp);
-    sg[out_num].length = sizeof(resp);
+    sg[out_num].addr   = (void*)(&cmd->resp);
+    sg[out_num].length = sizeof(cmd->resp);
 
     if (len) {
         int data_idx = (datain ? 2 : 1);
@@ -72,9 +88,103 @@ virtio_scsi_process_op(struct disk_op_s *op)
         sg[data_idx].length = len;
     }
 
+    vring_add_buf(vq, sg, out_num, in_num, num_added, num_added);
+    return out_num + in_num;
+}
+
+// Split a read/write into several commands, spread them over the request
+// queues and wait for all of them before issuing the next batch.
+static int
+virtio_scsi_rw(struct virtio_lun_s *vlun, struct disk_op_s *op, int blocksize)
+{
+    struct virtio_scsi_ctrl *ctrl = vlun->ctrl;
+    int nreqs = op->count / VIRTIO_SCSI_MIN_SPLIT;
+    if (nreqs > VIRTIO_SCSI_MAX_REQS)
+        nreqs = VIRTIO_SCSI_MAX_REQS;
+    u32 chunk = DIV_ROUND_UP(op->count, nreqs ?: 1);
+    if (ctrl->max_sectors && chunk > ctrl->max_sectors)
+        chunk = ctrl->max_sectors;
+
+    struct disk_op_s sub = *op;
+    u32 remaining = op->count;
+    int ret = DISK_RET_SUCCESS;
+    while (remaining && ret == DISK_RET_SUCCESS) {
+        int queued[VIRTIO_SCSI_MAX_QUEUES], room[VIRTIO_SCSI_MAX_QUEUES];
+        int i, num_added = 0;
+        for (i = 0; i < ctrl->vq_count; i++) {
+            queued[i] = 0;
+            room[i] = ctrl->vqs[i]->vring.num;
+        }
+        while (remaining && num_added < VIRTIO_SCSI_MAX_REQS) {
+            int q = num_added % ctrl->vq_count;
+            if (room[q] < 3)
+                break;
+            sub.count = remaining < chunk ? remaining : chunk;
+            int used = virtio_scsi_add_cmd(vlun, ctrl->vqs[q]
+                                           , &ctrl->cmds[num_added], &sub
+                                           , queued[q]);
+            if (!used)
+                break;
+            room[q] -= used;
+            queued[q]++;
+            num_added++;
+            sub.lba += sub.count;
+            sub.buf_fl += sub.count * blocksize;
+            remaining -= sub.count;
+        }
+        if (!num_added)
+            return DISK_RET_EBADTRACK;
+
+        /* Kick every queue that got work before waiting on any of them */
+        for (i = 0; i < ctrl->vq_count; i++)
+            if (queued[i])
+                vring_kick(&ctrl->vp, ctrl->vqs[i], queued[i]);
+
+        /* Wait for all replies and reclaim virtqueue elements */
+        for (i = 0; i < ctrl->vq_count; i++) {
+            while (queued[i]--) {
+                while (!vring_more_used(ctrl->vqs[i]))
+                    usleep(5);
+                vring_get_buf(ctrl->vqs[i], NULL);
+            }
+        }
+
+        /* Clear interrupt status register.  Avoid leaving interrupts stuck if
+         * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
+         */
+        vp_get_isr(&ctrl->vp);
+
+        for (i = 0; i < num_added; i++) {
+            struct virtio_scsi_resp_cmd *resp = &ctrl->cmds[i].resp;
+            if (resp->response != VIRTIO_SCSI_S_OK || resp->status != 0)
+                ret = DISK_RET_EBADTRACK;
+        }
+    }
+    return ret;
+}
+
+int
+virtio_scsi_process_op(struct disk_op_s *op)
+{
+    if (! CONFIG_VIRTIO_SCSI)
+        return 0;
+    struct virtio_lun_s *vlun =
+        container_of(op->drive_gf, struct virtio_lun_s, drive);
+    struct virtio_scsi_ctrl *ctrl = vlun->ctrl;
+    struct vring_virtqueue *vq = ctrl->vqs[0];
+    struct virtio_scsi_cmd *cmd = &ctrl->cmds[0];
+
+    if (op->command == CMD_READ || op->command == CMD_WRITE) {
+        int blocksize = scsi_fill_cmd(op, cmd->req.cdb, 16);
+        if (blocksize < 0)
+            return default_process_op(op);
+        return virtio_scsi_rw(vlun, op, blocksize);
+    }
+
     /* Add to virtqueue and kick host */
-    vring_add_buf(vq, sg, out_num, in_num, 0, 0);
-    vring_kick(vp, vq, 1);
+    if (!virtio_scsi_add_cmd(vlun, vq, cmd, op, 0))
+        return default_process_op(op);
+    vring_kick(&ctrl->vp, vq, 1);
 
     /* Wait for reply */
     while (!vring_more_used(vq))
@@ -86,9 +196,9 @@ virtio_scsi_process_op(struct disk_op_s *op)
     /* Clear interrupt status register.  Avoid leaving interrupts stuck if
      * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
      */
-    vp_get_isr(vp);
+    vp_get_isr(&ctrl->vp);
 
-    if (resp.response == VIRTIO_SCSI_S_OK && resp.status == 0) {
+    if (cmd->resp.response == VIRTIO_SCSI_S_OK && cmd->resp.status == 0) {
         return DISK_RET_SUCCESS;
     }
     return DISK_RET_EBADTRACK;
@@ -96,15 +206,13 @@ virtio_scsi_process_op(struct disk_op_s *op)
 
 static void
 virtio_scsi_init_lun(struct virtio_lun_s *vlun, struct pci_device *pci,
-                     struct vp_device *vp, struct vring_virtqueue *vq,
-                     u16 target, u16 lun)
+                     struct virtio_scsi_ctrl *ctrl, u16 target, u16 lun)
 {
     memset(vlun, 0, sizeof(*vlun));
     vlun->drive.type = DTYPE_VIRTIO_SCSI;
     vlun->drive.cntl_id = pci->bdf;
     vlun->pci = pci;
-    vlun->vp = vp;
-    vlun->vq = vq;
+    vlun->ctrl = ctrl;
     vlun->target = target;
     vlun->lun = lun;
 }
@@ -119,7 +227,7 @@ virtio_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
         warn_noalloc();
         return -1;
     }
-    virtio_scsi_init_lun(vlun, tmpl_vlun->pci, tmpl_vlun->vp, tmpl_vlun->vq,
+    virtio_scsi_init_lun(vlun, tmpl_vlun->pci, tmpl_vlun->ctrl,
                          tmpl_vlun->target, lun);
 
     int prio = bootprio_find_scsi_device(vlun->pci, vlun->target, vlun->lun);
@@ -134,13 +242,13 @@ fail:
 }
 
 static int
-virtio_scsi_scan_target(struct pci_device *pci, struct vp_device *vp,
-                        struct vring_virtqueue *vq, u16 target)
+virtio_scsi_scan_target(struct pci_device *pci, struct virtio_scsi_ctrl *ctrl,
+                        u16 target)
 {
 
     struct virtio_lun_s vlun0;
 
-    virtio_scsi_init_lun(&vlun0, pci, vp, vq, target, 0);
+    virtio_scsi_init_lun(&vlun0, pci, ctrl, target, 0);
 
     int ret = scsi_rep_luns_scan(&vlun0.drive, virtio_scsi_add_lun);
     return ret < 0 ? 0 : ret;
@@ -151,43 +259,65 @@ init_virtio_scsi(void *data)
 {
     struct pci_device *pci = data;
     dprintf(1, "found virtio-scsi at %pP\n", pci);
-    struct vring_virtqueue *vq = NULL;
-    struct vp_device *vp = malloc_high(sizeof(*vp));
-    if (!vp) {
+    struct virtio_scsi_ctrl *ctrl = malloc_high(sizeof(*ctrl));
+    if (!ctrl) {
         warn_noalloc();
         return;
     }
+    memset(ctrl, 0, sizeof(*ctrl));
+    struct vp_device *vp = &ctrl->vp;
     vp_init_simple(vp, pci);
     u8 status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    u32 num_queues;
 
     if (vp->use_modern) {
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
+        u64 packed = CONFIG_VIRTIO_RING_PACKED ? 1ull << VIRTIO_F_RING_PACKED : 0;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        vp_set_features(vp, version1);
+        vp_set_features(vp, features & (version1 | packed));
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
             dprintf(1, "device didn't accept features: %pP\n", pci);
             goto fail;
         }
+        num_queues = vp_read(&vp->device, struct virtio_scsi_config, num_queues);
+        ctrl->max_sectors =
+            vp_read(&vp->device, struct virtio_scsi_config, max_sectors);
+    } else {
+        struct virtio_scsi_config cfg;
+        vp_get_legacy(vp, 0, &cfg, sizeof(cfg));
+        num_queues = cfg.num_queues;
+        ctrl->max_sectors = cfg.max_sectors;
     }
 
-    if (vp_find_vq(vp, 2, &vq) < 0 ) {
+    /* Queue 0 is the control queue, 1 the event queue and the request
+     * queues follow.  Use as many of them as the device offers. */
+    if (num_queues > VIRTIO_SCSI_MAX_QUEUES)
+        num_queues = VIRTIO_SCSI_MAX_QUEUES;
+    while (ctrl->vq_count < (num_queues ?: 1)) {
+        if (vp_find_vq(vp, 2 + ctrl->vq_count, &ctrl->vqs[ctrl->vq_count]) < 0)
+            break;
+        ctrl->vq_count++;
+    }
+    if (!ctrl->vq_count) {
         dprintf(1, "fail to find vq for virtio-scsi %pP\n", pci);
         goto fail;
     }
+    dprintf(3, "virtio-scsi %pP request queues=%d max_sectors=%u\n"
+            , pci, ctrl->vq_count, ctrl->max_sectors);
 
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(vp, status);
 
     int i, tot;
     for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(pci, vp, vq, i);
+        tot += virtio_scsi_scan_target(pci, ctrl, i);
 
     if (!tot)
         goto fail;
@@ -196,8 +326,9 @@ init_virtio_scsi(void *data)
 
 fail:
     vp_reset(vp);
-    free(vp);
-    free(vq);
+    for (i = 0; i < ctrl->vq_count; i++)
+        free(ctrl->vqs[i]);
+    free(ctrl);
 }
 
 void
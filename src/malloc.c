@@ -14,23 +14,33 @@
 #include "stacks.h" // wait_preempt
 #include "std/optionrom.h" // OPTION_ROM_ALIGN
 #include "string.h" // memset
+#include "x86.h" // __fls
 
 // Information on a reserved area.
 struct allocinfo_s {
     struct hlist_node node;
+    struct hlist_node binnode;
     u32 range_start, range_end, alloc_size;
+    u8 zoneid;
 };
 
 // Information on a tracked memory allocation.
 struct allocdetail_s {
     struct allocinfo_s detailinfo;
     struct allocinfo_s datainfo;
+    struct hlist_node hashnode, handlenode;
     u32 handle;
+    u8 site;
 };
 
+// Number of free space size classes in each zone.
+#define MALLOC_BINS 16
+
 // The various memory zones.
 struct zone_s {
     struct hlist_head head;
+    // Entries with unused space after them - by size class of that space.
+    struct hlist_head bins[MALLOC_BINS];
 };
 
 struct zone_s ZoneLow VARVERIFY32INIT, ZoneHigh VARVERIFY32INIT;
@@ -41,34 +51,124 @@ static struct zone_s *Zones[] VARVERIFY32INIT = {
     &ZoneTmpLow, &ZoneLow, &ZoneFSeg, &ZoneTmpHigh, &ZoneHigh
 };
 
+// Tracked allocations indexed by data address and by PMM handle.
+#define MALLOC_HASH_SIZE 64
+static struct hlist_head AllocHash[MALLOC_HASH_SIZE] VARVERIFY32INIT;
+static struct hlist_head HandleHash[MALLOC_HASH_SIZE] VARVERIFY32INIT;
+
+// Allocator statistics (CONFIG_MALLOC_STATS).
+static struct {
+    u32 allocs, frees, alloc_walk, find_walk;
+} MallocStats VARVERIFY32INIT;
+
+// Usage report (CONFIG_MALLOC_STATS) - also the int 15h ax=e8f0 format.
+#define MALLOC_SITES 32
+
+struct malloc_zonestat_s {
+    u32 used, peak, fails;
+};
+
+struct malloc_sitestat_s {
+    u32 caller, bytes, live;
+    u16 count, fails;
+    u8 zoneid, pad[3];
+};
+
+struct malloc_report_s {
+    u32 signature;
+    u16 size;
+    u8 zonecount, sitecount;
+    struct malloc_zonestat_s zones[ARRAY_SIZE(Zones)];
+    struct malloc_sitestat_s sites[MALLOC_SITES];
+};
+
+static struct malloc_report_s MallocUsage VARVERIFY32INIT;
+
+// Copy of the report kept in the f-segment for int 15h ax=e8f0.  Only
+// referenced when CONFIG_MALLOC_STATS is set, so the linker discards
+// them otherwise.
+u32 MallocReport VARFSEG, MallocReportSize VARFSEG;
+
 
 /****************************************************************
  * low-level memory reservations
  ****************************************************************/
 
+static int
+zone_index(struct zone_s *zone)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++)
+        if (Zones[i] == zone)
+            return i;
+    return 0;
+}
+
+// Return the size class for a given amount of free space.
+static int
+alloc_bin(u32 space)
+{
+    if (space < 32)
+        return 0;
+    int bin = __fls(space) - 4;
+    return bin < MALLOC_BINS ? bin : MALLOC_BINS - 1;
+}
+
+// Update the size class of an entry after its free space changed.
+static void
+alloc_rebin(struct allocinfo_s *info)
+{
+    if (info->binnode.pprev)
+        hlist_del(&info->binnode);
+    info->binnode.pprev = NULL;
+    u32 space = info->range_end - info->range_start - info->alloc_size;
+    if (space)
+        hlist_add_head(&info->binnode
+                       , &Zones[info->zoneid]->bins[alloc_bin(space)]);
+}
+
 // Find and reserve space from a given zone
 static u32
 alloc_new(struct zone_s *zone, u32 size, u32 align, struct allocinfo_s *fill)
 {
-    struct allocinfo_s *info;
-    hlist_for_each_entry(info, &zone->head, node) {
-        u32 alloc_end = info->range_start + info->alloc_size;
-        u32 range_end = info->range_end;
-        u32 new_range_end = ALIGN_DOWN(range_end - size, align);
-        if (new_range_end >= alloc_end && new_range_end <= range_end) {
-            // Found space - now reserve it.
-            fill->range_start = new_range_end;
-            fill->range_end = range_end;
-            fill->alloc_size = size;
-
-            info->range_end = new_range_end;
-            hlist_add_before(&fill->node, &info->node);
-            return new_range_end;
+    // Only entries in the size class of 'size' or larger can fit it.
+    int bin;
+    for (bin = alloc_bin(size); bin < MALLOC_BINS; bin++) {
+        struct allocinfo_s *info;
+        hlist_for_each_entry(info, &zone->bins[bin], binnode) {
+            if (CONFIG_MALLOC_STATS)
+                MallocStats.alloc_walk++;
+            u32 alloc_end = info->range_start + info->alloc_size;
+            u32 range_end = info->range_end;
+            u32 new_range_end = ALIGN_DOWN(range_end - size, align);
+            if (new_range_end >= alloc_end && new_range_end <= range_end) {
+                // Found space - now reserve it.
+                fill->range_start = new_range_end;
+                fill->range_end = range_end;
+                fill->alloc_size = size;
+                fill->zoneid = info->zoneid;
+                fill->binnode.pprev = NULL;
+
+                info->range_end = new_range_end;
+                hlist_add_before(&fill->node, &info->node);
+                alloc_rebin(info);
+                alloc_rebin(fill);
+                return new_range_end;
+            }
         }
     }
     return 0;
 }
 
+// Move the list entries of 'old' to its copy 'new'.
+static void
+alloc_replace(struct allocinfo_s *old, struct allocinfo_s *new)
+{
+    hlist_replace(&old->node, &new->node);
+    if (old->binnode.pprev)
+        hlist_replace(&old->binnode, &new->binnode);
+}
+
 // Reserve space for a 'struct allocdetail_s' and fill
 static struct allocdetail_s *
 alloc_new_detail(struct allocdetail_s *temp)
@@ -87,8 +187,8 @@ alloc_new_detail(struct allocdetail_s *temp)
 
     // Fill final 'detail' allocation from data in 'temp'
     memcpy(detail, temp, sizeof(*detail));
-    hlist_replace(&temp->detailinfo.node, &detail->detailinfo.node);
-    hlist_replace(&temp->datainfo.node, &detail->datainfo.node);
+    alloc_replace(&temp->detailinfo, &detail->detailinfo);
+    alloc_replace(&temp->datainfo, &detail->datainfo);
     return detail;
 }
 
@@ -107,15 +207,22 @@ alloc_add(struct zone_s *zone, u32 start, u32 end)
     // Add space using temporary allocation info.
     struct allocdetail_s tempdetail;
     tempdetail.handle = MALLOC_DEFAULT_HANDLE;
+    tempdetail.handlenode.pprev = NULL;
     tempdetail.datainfo.range_start = start;
     tempdetail.datainfo.range_end = end;
     tempdetail.datainfo.alloc_size = 0;
+    tempdetail.datainfo.zoneid = zone_index(zone);
+    tempdetail.datainfo.binnode.pprev = NULL;
     hlist_add(&tempdetail.datainfo.node, pprev);
+    alloc_rebin(&tempdetail.datainfo);
 
     // Allocate final allocation info.
     struct allocdetail_s *detail = alloc_new_detail(&tempdetail);
-    if (!detail)
+    if (!detail) {
         hlist_del(&tempdetail.datainfo.node);
+        if (tempdetail.datainfo.binnode.pprev)
+            hlist_del(&tempdetail.datainfo.binnode);
+    }
 }
 
 // Release space allocated with alloc_new()
@@ -124,22 +231,31 @@ alloc_free(struct allocinfo_s *info)
 {
     struct allocinfo_s *next = container_of_or_null(
         info->node.next, struct allocinfo_s, node);
-    if (next && next->range_end == info->range_start)
-        next->range_end = info->range_end;
+    if (info->binnode.pprev)
+        hlist_del(&info->binnode);
     hlist_del(&info->node);
+    if (next && next->range_end == info->range_start) {
+        next->range_end = info->range_end;
+        alloc_rebin(next);
+    }
 }
 
-// Search all zones for an allocation obtained from alloc_new()
-static struct allocinfo_s *
+static u32
+alloc_hash(u32 key)
+{
+    return (key * 2654435761u) >> 26;
+}
+
+// Find a tracked allocation obtained from malloc_palloc()
+static struct allocdetail_s *
 alloc_find(u32 data)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->range_start == data)
-                return info;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, &AllocHash[alloc_hash(data)], hashnode) {
+        if (CONFIG_MALLOC_STATS)
+            MallocStats.find_walk++;
+        if (detail->datainfo.range_start == data)
+            return detail;
     }
     return NULL;
 }
@@ -218,42 +334,148 @@ zonelow_expand(u32 size, u32 align, struct allocinfo_s *fill)
         return 0;
 
     // Update zone
-    if (ebda_end == bottom)
+    if (ebda_end == bottom) {
         info->range_start = newbottom;
-    else
+        alloc_rebin(info);
+    } else {
         alloc_add(&ZoneLow, newbottom, ebda_end);
+    }
 
     return alloc_new(&ZoneLow, size, align, fill);
 }
 
 
+/****************************************************************
+ * Usage accounting
+ ****************************************************************/
+
+// Find the accounting slot for allocations from 'caller' in a zone.
+// When the table is full the last slot collects all other callers.
+static int
+malloc_site(u32 caller, int zoneid)
+{
+    int i;
+    for (i=0; i<MALLOC_SITES-1; i++) {
+        struct malloc_sitestat_s *site = &MallocUsage.sites[i];
+        if (!site->count && !site->fails) {
+            site->caller = caller;
+            site->zoneid = zoneid;
+            return i;
+        }
+        if (site->caller == caller && site->zoneid == zoneid)
+            return i;
+    }
+    MallocUsage.sites[i].zoneid = 0xff;
+    return i;
+}
+
+static void
+malloc_account(struct zone_s *zone, u32 size, u32 caller
+               , struct allocdetail_s *detail)
+{
+    if (!CONFIG_MALLOC_STATS)
+        return;
+    int zoneid = zone_index(zone);
+    struct malloc_zonestat_s *zs = &MallocUsage.zones[zoneid];
+    struct malloc_sitestat_s *site = &MallocUsage.sites[
+        malloc_site(caller, zoneid)];
+    if (!detail) {
+        zs->fails++;
+        site->fails++;
+        return;
+    }
+    detail->site = site - MallocUsage.sites;
+    zs->used += size;
+    if (zs->used > zs->peak)
+        zs->peak = zs->used;
+    site->count++;
+    site->bytes += size;
+    site->live += size;
+}
+
+static void
+malloc_unaccount(struct allocdetail_s *detail, u32 size)
+{
+    if (!CONFIG_MALLOC_STATS)
+        return;
+    MallocUsage.zones[detail->datainfo.zoneid].used -= size;
+    MallocUsage.sites[detail->site].live -= size;
+}
+
+// Print the usage report and keep a copy for int 15h ax=e8f0.
+static void
+malloc_report(void)
+{
+    if (!CONFIG_MALLOC_STATS)
+        return;
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++) {
+        struct malloc_zonestat_s *zs = &MallocUsage.zones[i];
+        dprintf(1, "malloc zone %p: used=%d peak=%d fails=%d\n"
+                , Zones[i], zs->used, zs->peak, zs->fails);
+    }
+    int count = 0;
+    for (i=0; i<MALLOC_SITES; i++) {
+        struct malloc_sitestat_s *site = &MallocUsage.sites[i];
+        if (!site->count && !site->fails)
+            continue;
+        count = i + 1;
+        dprintf(1, "malloc site %08x zone=%p: allocs=%d bytes=%d live=%d"
+                " fails=%d\n", site->caller
+                , site->zoneid < ARRAY_SIZE(Zones) ? Zones[site->zoneid] : NULL
+                , site->count, site->bytes, site->live, site->fails);
+    }
+
+    MallocUsage.signature = MALLOC_REPORT_SIGNATURE;
+    MallocUsage.zonecount = ARRAY_SIZE(Zones);
+    MallocUsage.sitecount = count;
+    MallocUsage.size = (sizeof(MallocUsage) - sizeof(MallocUsage.sites)
+                        + count * sizeof(MallocUsage.sites[0]));
+    struct malloc_report_s *report = malloc_fseg(MallocUsage.size);
+    if (!report) {
+        warn_noalloc();
+        return;
+    }
+    memcpy(report, &MallocUsage, MallocUsage.size);
+    MallocReport = (u32)report;
+    MallocReportSize = MallocUsage.size;
+}
+
+
 /****************************************************************
  * tracked memory allocations
  ****************************************************************/
 
-// Allocate physical memory from the given zone and track it as a PMM allocation
-u32
-malloc_palloc(struct zone_s *zone, u32 size, u32 align)
+static u32
+__malloc_palloc(struct zone_s *zone, u32 size, u32 align, u32 caller)
 {
-    ASSERT32FLAT();
     if (!size)
         return 0;
 
     // Find and reserve space for main allocation
     struct allocdetail_s tempdetail;
     tempdetail.handle = MALLOC_DEFAULT_HANDLE;
+    tempdetail.handlenode.pprev = NULL;
+    tempdetail.site = 0;
     u32 data = alloc_new(zone, size, align, &tempdetail.datainfo);
     if (!CONFIG_MALLOC_UPPERMEMORY && !data && zone == &ZoneLow)
         data = zonelow_expand(size, align, &tempdetail.datainfo);
-    if (!data)
+    if (!data) {
+        malloc_account(zone, size, caller, NULL);
         return 0;
+    }
 
     // Find and reserve space for bookkeeping.
     struct allocdetail_s *detail = alloc_new_detail(&tempdetail);
     if (!detail) {
         alloc_free(&tempdetail.datainfo);
+        malloc_account(zone, size, caller, NULL);
         return 0;
     }
+    hlist_add_head(&detail->hashnode, &AllocHash[alloc_hash(data)]);
+    if (CONFIG_MALLOC_STATS)
+        MallocStats.allocs++;
+    malloc_account(zone, size, caller, detail);
 
     dprintf(8, "phys_alloc zone=%p size=%d align=%x ret=%x (detail=%p)\n"
             , zone, size, align, data, detail);
@@ -261,11 +483,23 @@ malloc_palloc(struct zone_s *zone, u32 size, u32 align)
     return data;
 }
 
+// Allocate physical memory from the given zone and track it as a PMM allocation
+u32
+malloc_palloc(struct zone_s *zone, u32 size, u32 align)
+{
+    ASSERT32FLAT();
+    return __malloc_palloc(zone, size, align
+                           , (u32)__builtin_return_address(0));
+}
+
 // Allocate virtual memory from the given zone
 void * __malloc
 _malloc(struct zone_s *zone, u32 size, u32 align)
 {
-    return memremap(malloc_palloc(zone, size, align), size);
+    ASSERT32FLAT();
+    u32 data = __malloc_palloc(zone, size, align
+                               , (u32)__builtin_return_address(0));
+    return memremap(data, size);
 }
 
 // Free a data block allocated with phys_alloc
@@ -273,14 +507,18 @@ int
 malloc_pfree(u32 data)
 {
     ASSERT32FLAT();
-    struct allocinfo_s *info = alloc_find(data);
-    if (!info || data == virt_to_phys(info) || !info->alloc_size)
+    struct allocdetail_s *detail = alloc_find(data);
+    if (!detail)
         return -1;
-    struct allocdetail_s *detail = container_of(
-        info, struct allocdetail_s, datainfo);
     dprintf(8, "phys_free %x (detail=%p)\n", data, detail);
-    alloc_free(info);
+    hlist_del(&detail->hashnode);
+    if (detail->handlenode.pprev)
+        hlist_del(&detail->handlenode);
+    malloc_unaccount(detail, detail->datainfo.alloc_size);
+    alloc_free(&detail->datainfo);
     alloc_free(&detail->detailinfo);
+    if (CONFIG_MALLOC_STATS)
+        MallocStats.frees++;
     return 0;
 }
 
@@ -294,6 +532,40 @@ free(void *data)
         warn_internalerror();
 }
 
+// Give back the parts of an allocation outside of 'size' bytes at
+// 'offset'.  The space before 'offset' can only be released when free
+// space of the zone precedes the allocation - the returned pointer is
+// the (possibly unchanged) start of the allocation to pass to free().
+void *
+malloc_trim(void *data, u32 offset, u32 size)
+{
+    ASSERT32FLAT();
+    u32 start = virt_to_phys(data);
+    struct allocdetail_s *detail = alloc_find(start);
+    if (!detail || offset + size > detail->datainfo.alloc_size) {
+        warn_internalerror();
+        return data;
+    }
+    struct allocinfo_s *info = &detail->datainfo;
+    struct allocinfo_s *next = container_of_or_null(
+        info->node.next, struct allocinfo_s, node);
+    if (offset && next && next->range_end == start) {
+        hlist_del(&detail->hashnode);
+        start += offset;
+        next->range_end = start;
+        alloc_rebin(next);
+        info->range_start = start;
+        info->alloc_size -= offset;
+        hlist_add_head(&detail->hashnode, &AllocHash[alloc_hash(start)]);
+        malloc_unaccount(detail, offset);
+        offset = 0;
+    }
+    malloc_unaccount(detail, info->alloc_size - offset - size);
+    info->alloc_size = offset + size;
+    alloc_rebin(info);
+    return memremap(start, info->alloc_size);
+}
+
 // Find the amount of free space in a given zone.
 u32
 malloc_getspace(struct zone_s *zone)
@@ -322,34 +594,89 @@ void
 malloc_sethandle(u32 data, u32 handle)
 {
     ASSERT32FLAT();
-    struct allocinfo_s *info = alloc_find(data);
-    if (!info || data == virt_to_phys(info) || !info->alloc_size)
+    struct allocdetail_s *detail = alloc_find(data);
+    if (!detail)
         return;
-    struct allocdetail_s *detail = container_of(
-        info, struct allocdetail_s, datainfo);
+    if (detail->handlenode.pprev)
+        hlist_del(&detail->handlenode);
+    detail->handlenode.pprev = NULL;
     detail->handle = handle;
+    if (handle != MALLOC_DEFAULT_HANDLE)
+        hlist_add_head(&detail->handlenode, &HandleHash[alloc_hash(handle)]);
 }
 
 // Find the data block allocated with phys_alloc with a given handle.
 u32
 malloc_findhandle(u32 handle)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->range_start != virt_to_phys(info))
-                continue;
-            struct allocdetail_s *detail = container_of(
-                info, struct allocdetail_s, detailinfo);
-            if (detail->handle == handle)
-                return detail->datainfo.range_start;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, &HandleHash[alloc_hash(handle)], handlenode) {
+        if (CONFIG_MALLOC_STATS)
+            MallocStats.find_walk++;
+        if (detail->handle == handle)
+            return detail->datainfo.range_start;
     }
     return 0;
 }
 
 
+/****************************************************************
+ * Scratch arenas
+ ****************************************************************/
+
+struct arena_chunk_s {
+    struct arena_chunk_s *prev;
+    void *end;
+};
+
+#define ARENA_CHUNK_SIZE 4096
+
+// Allocate scratch memory from an arena.
+void *
+arena_alloc(struct arena_s *arena, u32 size, u32 align)
+{
+    ASSERT32FLAT();
+    if (!size)
+        return NULL;
+    void *data = (void*)ALIGN((u32)arena->pos, align);
+    if (!arena->chunk || data < arena->pos || data + size > arena->end
+        || data + size < data) {
+        // Start a new chunk.
+        u32 chunksize = sizeof(struct arena_chunk_s) + size + align;
+        if (chunksize < ARENA_CHUNK_SIZE)
+            chunksize = ARENA_CHUNK_SIZE;
+        struct arena_chunk_s *chunk = _malloc(arena->zone, chunksize
+                                              , MALLOC_MIN_ALIGN);
+        if (!chunk)
+            return NULL;
+        chunk->prev = arena->chunk;
+        chunk->end = (void*)chunk + chunksize;
+        arena->chunk = chunk;
+        arena->end = chunk->end;
+        data = (void*)ALIGN((u32)&chunk[1], align);
+    }
+    arena->pos = data + size;
+    return data;
+}
+
+// Release everything allocated since arena_mark() returned 'mark'.  A
+// NULL mark releases the whole arena.
+void
+arena_release(struct arena_s *arena, void *mark)
+{
+    ASSERT32FLAT();
+    struct arena_chunk_s *chunk = arena->chunk;
+    while (chunk && !(mark > (void*)chunk && mark <= chunk->end)) {
+        struct arena_chunk_s *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    arena->chunk = chunk;
+    arena->pos = chunk ? mark : NULL;
+    arena->end = chunk ? chunk->end : NULL;
+}
+
+
 /****************************************************************
  * 0xc0000-0xf0000 management
  ****************************************************************/
@@ -387,6 +714,7 @@ rom_reserve(u32 size)
         if (newend < SYMBOL(zonelow_base))
             newend = SYMBOL(zonelow_base);
         RomBase->range_start = newend + OPROM_HEADER_RESERVE;
+        alloc_rebin(RomBase);
     }
     return (void*)RomEnd;
 }
@@ -409,6 +737,13 @@ rom_confirm(u32 size)
  * Setup
  ****************************************************************/
 
+static void
+hlist_fixup(struct hlist_head *head)
+{
+    if (head->first)
+        head->first->pprev = &head->first;
+}
+
 void
 malloc_preinit(void)
 {
@@ -494,11 +829,16 @@ malloc_init(void)
 
     if (CONFIG_RELOCATE_INIT) {
         // Fixup malloc pointers after relocation
-        int i;
+        int i, j;
         for (i=0; i<ARRAY_SIZE(Zones); i++) {
             struct zone_s *zone = Zones[i];
-            if (zone->head.first)
-                zone->head.first->pprev = &zone->head.first;
+            hlist_fixup(&zone->head);
+            for (j=0; j<MALLOC_BINS; j++)
+                hlist_fixup(&zone->bins[j]);
+        }
+        for (i=0; i<ARRAY_SIZE(AllocHash); i++) {
+            hlist_fixup(&AllocHash[i]);
+            hlist_fixup(&HandleHash[i]);
         }
     }
 
@@ -527,6 +867,13 @@ malloc_prepboot(void)
 {
     ASSERT32FLAT();
     dprintf(3, "malloc finalize\n");
+    if (CONFIG_MALLOC_STATS) {
+        dprintf(1, "malloc: %d allocs, %d frees, %d alloc walk steps"
+                ", %d lookup walk steps\n", MallocStats.allocs
+                , MallocStats.frees, MallocStats.alloc_walk
+                , MallocStats.find_walk);
+    }
+    malloc_report();
 
     u32 base = rom_get_max();
     memset((void*)RomEnd, 0, base-RomEnd);
@@ -13,16 +13,32 @@ void malloc_csm_preinit(u32 low_pmm, u32 low_pmm_size, u32 hi_pmm,
                         u32 hi_pmm_size);
 void malloc_preinit(void);
 extern u32 LegacyRamSize;
+#define MALLOC_REPORT_SIGNATURE 0x434f4c4d // MLOC
+extern u32 MallocReport, MallocReportSize;
 void malloc_init(void);
 void malloc_prepboot(void);
 u32 malloc_palloc(struct zone_s *zone, u32 size, u32 align);
 void *_malloc(struct zone_s *zone, u32 size, u32 align);
 int malloc_pfree(u32 data);
 void free(void *data);
+void *malloc_trim(void *data, u32 offset, u32 size);
 u32 malloc_getspace(struct zone_s *zone);
 void malloc_sethandle(u32 data, u32 handle);
 u32 malloc_findhandle(u32 handle);
 
+// Bump allocator for short lived scratch memory - everything allocated
+// after a mark is released together.
+struct arena_s {
+    struct zone_s *zone;
+    struct arena_chunk_s *chunk;
+    void *pos, *end;
+};
+void *arena_alloc(struct arena_s *arena, u32 size, u32 align);
+void arena_release(struct arena_s *arena, void *mark);
+static inline void *arena_mark(struct arena_s *arena) {
+    return arena->pos;
+}
+
 #define MALLOC_DEFAULT_HANDLE 0xFFFFFFFF
 // Minimum alignment of malloc'd memory
 #define MALLOC_MIN_ALIGN 16
@@ -54,14 +54,19 @@ __callrom(struct rom_header *rom, u16 offset, u16 bdf)
 void
 callrom(struct rom_header *rom, u16 bdf)
 {
+    int prof = bootprof_start(BOOTPROF_OPTIONROM, "optionrom"
+                              , (bdf << 16) | FLATPTR_TO_SEG(rom));
     __callrom(rom, OPTION_ROM_INITVECTOR, bdf);
+    bootprof_stop(prof);
 }
 
 // Execute a BCV option rom registered via add_bcv().
 void
 call_bcv(u16 seg, u16 ip)
 {
+    int prof = bootprof_start(BOOTPROF_BCV, "bcv", (seg << 16) | ip);
     __callrom(MAKE_FLATPTR(seg, 0), ip, 0);
+    bootprof_stop(prof);
 }
 
 // Verify that an option rom looks valid
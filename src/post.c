@@ -103,6 +103,7 @@ interface_init(void)
 {
     // Running at new code address - do code relocation fixups
     malloc_init();
+    bootprof_setup();
 
     // Setup romfile items.
     qemu_cfg_init();
@@ -168,6 +169,8 @@ prepareboot(void)
 
     // Finalize data structures before boot
     cdrom_prepboot();
+    block_cache_prepboot();
+    disk_stats_prepboot();
     pmm_prepboot();
     malloc_prepboot();
     e820_prepboot();
@@ -197,33 +200,43 @@ static void
 maininit(void)
 {
     // Initialize internal interfaces.
+    bootprof_phase("interface");
     interface_init();
 
     // Setup platform devices.
+    bootprof_phase("platform");
     platform_hardware_setup();
 
     // Start hardware initialization (if threads allowed during optionroms)
-    if (threads_during_optionroms())
+    if (threads_during_optionroms()) {
+        bootprof_phase("device");
         device_hardware_setup();
+    }
 
     // Run vga option rom
+    bootprof_phase("vgarom");
     vgarom_setup();
 
     // Do hardware initialization (if running synchronously)
     if (!threads_during_optionroms()) {
+        bootprof_phase("device");
         device_hardware_setup();
         wait_threads();
     }
 
     // Run option roms
+    bootprof_phase("optionrom");
     optionrom_setup();
 
     // Allow user to modify overall boot order.
+    bootprof_phase("bootmenu");
     interactive_bootmenu();
     wait_threads();
 
     // Prepare for boot.
+    bootprof_phase("prepboot");
     prepareboot();
+    bootprof_finish();
 
     // Write protect bios memory.
     make_bios_readonly();
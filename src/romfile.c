@@ -47,10 +47,8 @@ romfile_find(const char *name)
     return __romfile_findprefix(name, strlen(name) + 1, NULL);
 }
 
-// Helper function to find, malloc_tmphigh, and copy a romfile.  This
-// function adds a trailing zero to the malloc'd copy.
-void *
-romfile_loadfile(const char *name, int *psize)
+static void *
+__romfile_loadfile(const char *name, int *psize, struct arena_s *arena)
 {
     struct romfile_s *file = romfile_find(name);
     if (!file)
@@ -60,7 +58,9 @@ romfile_loadfile(const char *name, int *psize)
     if (!filesize)
         return NULL;
 
-    char *data = malloc_tmphigh(filesize+1);
+    void *mark = arena ? arena_mark(arena) : NULL;
+    char *data = (arena ? arena_alloc(arena, filesize+1, MALLOC_MIN_ALIGN)
+                  : malloc_tmphigh(filesize+1));
     if (!data) {
         warn_noalloc();
         return NULL;
@@ -69,7 +69,10 @@ romfile_loadfile(const char *name, int *psize)
     dprintf(5, "Copying romfile '%s' (len %d)\n", name, filesize);
     int ret = file->copy(file, data, filesize);
     if (ret < 0) {
-        free(data);
+        if (arena)
+            arena_release(arena, mark);
+        else
+            free(data);
         return NULL;
     }
     if (psize)
@@ -78,6 +81,21 @@ romfile_loadfile(const char *name, int *psize)
     return data;
 }
 
+// Helper function to find, malloc_tmphigh, and copy a romfile.  This
+// function adds a trailing zero to the malloc'd copy.
+void *
+romfile_loadfile(const char *name, int *psize)
+{
+    return __romfile_loadfile(name, psize, NULL);
+}
+
+// Copy a romfile (with a trailing zero) into scratch arena memory.
+void *
+romfile_loadfile_arena(struct arena_s *arena, const char *name, int *psize)
+{
+    return __romfile_loadfile(name, psize, arena);
+}
+
 // Attempt to load an integer from the given file - return 'defval'
 // if unsuccessful.
 u64
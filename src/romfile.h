@@ -14,6 +14,9 @@ void romfile_add(struct romfile_s *file);
 struct romfile_s *romfile_findprefix(const char *prefix, struct romfile_s *prev);
 struct romfile_s *romfile_find(const char *name);
 void *romfile_loadfile(const char *name, int *psize);
+struct arena_s;
+void *romfile_loadfile_arena(struct arena_s *arena, const char *name
+                             , int *psize);
 u64 romfile_loadint(const char *name, u64 defval);
 
 #endif // romfile.h
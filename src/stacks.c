@@ -465,6 +465,7 @@ reset(void)
 struct thread_info {
     void *stackpos;
     struct hlist_node node;
+    int prof;
 };
 struct thread_info MainThread VARFSEG = {
     NULL, { &MainThread.node, &MainThread.node.next }
@@ -535,6 +536,7 @@ static void
 __end_thread(struct thread_info *old)
 {
     hlist_del(&old->node);
+    bootprof_stop(old->prof);
     dprintf(DEBUG_thread, "\\%08x/ End thread\n", (u32)old);
     free(old);
     if (!have_threads())
@@ -546,6 +548,7 @@ void
 run_thread(void (*func)(void*), void *data)
 {
     ASSERT32FLAT();
+    int prof;
     if (! CONFIG_THREADS || ! ThreadControl)
         goto fail;
     struct thread_info *thread;
@@ -555,6 +558,7 @@ run_thread(void (*func)(void*), void *data)
 
     dprintf(DEBUG_thread, "/%08x\\ Start thread\n", (u32)thread);
     thread->stackpos = (void*)thread + THREADSTACKSIZE;
+    thread->prof = bootprof_start(BOOTPROF_THREAD, "thread", (u32)func);
     struct thread_info *cur = getCurThread();
     hlist_add_after(&thread->node, &cur->node);
     asm volatile(
@@ -580,7 +584,9 @@ run_thread(void (*func)(void*), void *data)
     return;
 
 fail:
+    prof = bootprof_start(BOOTPROF_THREAD, "thread", (u32)func);
     func(data);
+    bootprof_stop(prof);
 }
 
 
@@ -9,7 +9,7 @@
 #include "bregs.h" // struct bregs
 #include "e820map.h" // E820_RAM
 #include "hw/pic.h" // pic_reset
-#include "malloc.h" // LegacyRamSize
+#include "malloc.h" // LegacyRamSize, MallocReport, MALLOC_REPORT_SIGNATURE
 #include "output.h" // debug_enter
 #include "string.h" // memcpy_far
 #include "util.h" // handle_1553
@@ -308,6 +308,31 @@ handle_15e820(struct bregs *regs)
     set_success(regs);
 }
 
+// Vendor call: copy the allocator usage report (CONFIG_MALLOC_STATS)
+static void
+handle_15e8f0(struct bregs *regs)
+{
+    if (!CONFIG_MALLOC_STATS) {
+        set_code_invalid(regs, RET_EUNSUPPORTED);
+        return;
+    }
+    u32 report = GET_GLOBAL(MallocReport);
+    if (!report || regs->edx != MALLOC_REPORT_SIGNATURE) {
+        set_code_invalid(regs, RET_EUNSUPPORTED);
+        return;
+    }
+
+    u32 size = GET_GLOBAL(MallocReportSize);
+    u32 len = regs->ecx < size ? regs->ecx : size;
+    memcpy_far(regs->es, (void*)(regs->di+0)
+               , FLATPTR_TO_SEG(report), (void*)FLATPTR_TO_OFFSET(report)
+               , len);
+    regs->eax = MALLOC_REPORT_SIGNATURE;
+    regs->ecx = len;
+    regs->edx = size;
+    set_success(regs);
+}
+
 static void
 handle_15e8XX(struct bregs *regs)
 {
@@ -320,6 +345,7 @@ handle_15e8(struct bregs *regs)
     switch (regs->al) {
     case 0x01: handle_15e801(regs); break;
     case 0x20: handle_15e820(regs); break;
+    case 0xf0: handle_15e8f0(regs); break;
     default:   handle_15e8XX(regs); break;
     }
 }
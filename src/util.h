@@ -38,6 +38,19 @@ struct usbdevice_s;
 int bootprio_find_usb(struct usbdevice_s *usbdev, int lun);
 int get_keystroke(int msec);
 
+// bootprof.c
+#define BOOTPROF_PHASE     1
+#define BOOTPROF_THREAD    2
+#define BOOTPROF_OPTIONROM 3
+#define BOOTPROF_BCV       4
+void bootprof_timer_prechange(void);
+void bootprof_timer_postchange(void);
+int bootprof_start(int type, const char *name, u32 id);
+void bootprof_stop(int idx);
+void bootprof_phase(const char *name);
+void bootprof_setup(void);
+void bootprof_finish(void);
+
 // bootsplash.c
 void enable_vga_console(void);
 void enable_bootsplash(void);
@@ -154,6 +167,7 @@ void floppy_tick(void);
 // hw/ramdisk.c
 void ramdisk_setup(void);
 int ramdisk_process_op(struct disk_op_s *op);
+int ramdisk_lzma_process_op(struct disk_op_s *op);
 
 // hw/sdcard.c
 int sdcard_process_op(struct disk_op_s *op);
@@ -162,9 +176,12 @@ void sdcard_setup(void);
 // hw/timer.c
 void timer_setup(void);
 void pmtimer_setup(u16 ioport);
+u32 timer_read(void);
 u32 timer_calc(u32 msecs);
 u32 timer_calc_usec(u32 usecs);
+u32 timer_ticks_to_usec(u32 ticks);
 int timer_check(u32 end);
+void timer_sleep_until(u32 end);
 void ndelay(u32 count);
 void udelay(u32 count);
 void mdelay(u32 count);